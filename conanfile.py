@@ -15,7 +15,10 @@ class ExportMKVConan(ConanFile):
 
     requires = (
         "kinect-azure-sensor-sdk/1.4.1@camposs/stable",
-        "fmt/7.1.3"
+        "fmt/7.1.3",
+        "xxhash/0.8.0",
+        "libjpeg-turbo/2.0.5",
+        "libpng/1.6.37"
          )
 
     # all sources are deployed with the package
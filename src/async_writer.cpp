@@ -0,0 +1,419 @@
+#include "async_writer.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// consecutive failed io_uring_enter calls after which drain() gives up on writes still in flight
+static const int max_reap_failures = 100;
+
+AsyncWriter::AsyncWriter(size_t buffer_size, size_t buffer_count, bool direct_io) :
+    m_buffer_size((buffer_size + alignment - 1) / alignment * alignment),
+    m_direct_io(direct_io)
+{
+    m_slots.resize(buffer_count);
+    for (auto &slot : m_slots)
+    {
+        slot.data = static_cast<uint8_t *>(std::aligned_alloc(alignment, m_buffer_size));
+        slot.length = 0;
+        slot.offset = 0;
+        slot.busy = false;
+        if (slot.data == nullptr)
+        {
+            m_failed = true;
+        }
+    }
+}
+
+AsyncWriter::~AsyncWriter()
+{
+    close();
+    if (m_in_flight > 0)
+    {
+        // the ring could not be reaped and the kernel may still read these buffers and their iovecs, moving
+        // the vector keeps its storage where it is. Leaking it is better than handing the kernel reused memory.
+        std::cerr << "Leaking " << m_slots.size() << " write buffers with " << m_in_flight
+                  << " writes still in flight." << std::endl;
+        new std::vector<Slot>(std::move(m_slots));
+        return;
+    }
+    for (auto &slot : m_slots)
+    {
+        std::free(slot.data);
+    }
+}
+
+bool AsyncWriter::open(const std::string &path)
+{
+    if (m_failed)
+    {
+        return false;
+    }
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (m_direct_io)
+    {
+        flags |= O_DIRECT;
+    }
+    m_fd = ::open(path.c_str(), flags, 0644);
+    if (m_fd < 0 && m_direct_io && errno == EINVAL)
+    {
+        std::cerr << "O_DIRECT not supported for " << path << ", using buffered I/O." << std::endl;
+        m_fd = ::open(path.c_str(), flags & ~O_DIRECT, 0644);
+    }
+    if (m_fd < 0)
+    {
+        std::cerr << "Unable to open " << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    if (!setup_ring(static_cast<unsigned>(m_slots.size())))
+    {
+        m_stopping = false;
+        m_thread = std::thread(&AsyncWriter::thread_main, this);
+    }
+    return true;
+}
+
+bool AsyncWriter::setup_ring(unsigned entries)
+{
+    struct io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (fd < 0)
+    {
+        return false;
+    }
+    m_ring_fd = fd;
+
+    m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+    {
+        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    }
+
+    m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED)
+    {
+        m_sq_ptr = nullptr;
+        teardown_ring();
+        return false;
+    }
+    if (single_mmap)
+    {
+        m_cq_ptr = m_sq_ptr;
+    }
+    else
+    {
+        m_cq_ptr = mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (m_cq_ptr == MAP_FAILED)
+        {
+            m_cq_ptr = nullptr;
+            teardown_ring();
+            return false;
+        }
+    }
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED)
+    {
+        m_sqes = nullptr;
+        teardown_ring();
+        return false;
+    }
+
+    auto *sq = static_cast<uint8_t *>(m_sq_ptr);
+    m_sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    m_sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto *cq = static_cast<uint8_t *>(m_cq_ptr);
+    m_cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    m_cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    m_cqes = cq + params.cq_off.cqes;
+    return true;
+}
+
+void AsyncWriter::teardown_ring()
+{
+    if (m_sqes != nullptr)
+    {
+        munmap(m_sqes, m_sqes_size);
+        m_sqes = nullptr;
+    }
+    if (m_cq_ptr != nullptr && m_cq_ptr != m_sq_ptr)
+    {
+        munmap(m_cq_ptr, m_cq_size);
+    }
+    m_cq_ptr = nullptr;
+    if (m_sq_ptr != nullptr)
+    {
+        munmap(m_sq_ptr, m_sq_size);
+        m_sq_ptr = nullptr;
+    }
+    if (m_ring_fd >= 0)
+    {
+        ::close(m_ring_fd);
+        m_ring_fd = -1;
+    }
+}
+
+uint8_t *AsyncWriter::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_failed)
+    {
+        for (auto &slot : m_slots)
+        {
+            if (!slot.busy)
+            {
+                slot.busy = true;
+                return slot.data;
+            }
+        }
+        if (using_io_uring())
+        {
+            lock.unlock();
+            ring_reap(true);
+            lock.lock();
+        }
+        else
+        {
+            m_cv.wait(lock);
+        }
+    }
+    return nullptr;
+}
+
+bool AsyncWriter::submit(uint8_t *buffer, size_t length, uint64_t offset)
+{
+    size_t index = 0;
+    while (index < m_slots.size() && m_slots[index].data != buffer)
+    {
+        ++index;
+    }
+    if (index == m_slots.size())
+    {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Slot &slot = m_slots[index];
+    if (m_failed)
+    {
+        slot.busy = false;
+        return false;
+    }
+    slot.length = length;
+    slot.offset = offset;
+    ++m_in_flight;
+
+    if (using_io_uring())
+    {
+        lock.unlock();
+        // reap whatever already finished so the completion queue never overflows
+        ring_reap(false);
+        return ring_submit(index);
+    }
+    m_queue.push_back(index);
+    m_cv.notify_all();
+    return true;
+}
+
+bool AsyncWriter::ring_submit(size_t index)
+{
+    Slot &slot = m_slots[index];
+    slot.iov.iov_base = slot.data;
+    slot.iov.iov_len = slot.length;
+
+    unsigned tail = *m_sq_tail;
+    unsigned sq_index = tail & *m_sq_mask;
+    auto *sqe = static_cast<struct io_uring_sqe *>(m_sqes) + sq_index;
+    std::memset(sqe, 0, sizeof(*sqe));
+    // WRITEV rather than WRITE keeps this working on 5.1+ kernels
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = m_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&slot.iov);
+    sqe->len = 1;
+    sqe->off = slot.offset;
+    sqe->user_data = index;
+    m_sq_array[sq_index] = sq_index;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, m_ring_fd, 1, 0, 0, nullptr, 0) < 0)
+    {
+        int error = errno;
+        if (error != EINTR && error != EAGAIN && error != EBUSY)
+        {
+            ring_failed(error);
+            // without SQPOLL the kernel only consumes entries inside io_uring_enter. An entry it did not
+            // take is withdrawn and its slot released here, one it took still completes through the ring.
+            if (__atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) == tail)
+            {
+                __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+                complete(index, -error);
+            }
+            return false;
+        }
+        ring_reap(error != EINTR);
+    }
+    return true;
+}
+
+bool AsyncWriter::ring_reap(bool wait)
+{
+    bool reaped = false;
+    while (true)
+    {
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            auto *cqe = static_cast<struct io_uring_cqe *>(m_cqes) + (head & *m_cq_mask);
+            complete(static_cast<size_t>(cqe->user_data), cqe->res);
+            ++head;
+            reaped = true;
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+
+        if (reaped || !wait || m_in_flight == 0)
+        {
+            return reaped;
+        }
+        if (syscall(__NR_io_uring_enter, m_ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+        {
+            ring_failed(errno);
+            return false;
+        }
+    }
+}
+
+void AsyncWriter::ring_failed(int error)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_failed)
+        {
+            std::cerr << "io_uring_enter failed: " << std::strerror(error) << std::endl;
+        }
+        m_failed = true;
+    }
+    m_cv.notify_all();
+}
+
+void AsyncWriter::complete(size_t index, int64_t result)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Slot &slot = m_slots[index];
+    if (result < 0 || static_cast<size_t>(result) != slot.length)
+    {
+        if (!m_failed)
+        {
+            std::cerr << "Block write failed: "
+                      << (result < 0 ? std::strerror(static_cast<int>(-result)) : "short write") << std::endl;
+        }
+        m_failed = true;
+    }
+    slot.busy = false;
+    --m_in_flight;
+    m_cv.notify_all();
+}
+
+void AsyncWriter::thread_main()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true)
+    {
+        m_cv.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+        if (m_queue.empty())
+        {
+            return;
+        }
+        size_t index = m_queue.front();
+        m_queue.pop_front();
+        Slot slot = m_slots[index];
+        lock.unlock();
+
+        size_t written = 0;
+        int64_t result = 0;
+        while (written < slot.length)
+        {
+            ssize_t n = pwrite(m_fd, slot.data + written, slot.length - written, slot.offset + written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                result = -errno;
+                break;
+            }
+            written += n;
+        }
+        complete(index, result < 0 ? result : static_cast<int64_t>(written));
+        lock.lock();
+    }
+}
+
+bool AsyncWriter::drain()
+{
+    if (using_io_uring())
+    {
+        // the kernel owns the slot buffers until their completions are reaped, a failed reap is retried
+        int failures = 0;
+        while (m_in_flight > 0)
+        {
+            if (ring_reap(true))
+            {
+                failures = 0;
+            }
+            else if (++failures >= max_reap_failures)
+            {
+                break;
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+    }
+    else
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]() { return m_in_flight == 0; });
+    }
+    return !m_failed;
+}
+
+bool AsyncWriter::close()
+{
+    if (m_fd < 0)
+    {
+        return !m_failed;
+    }
+    drain();
+    if (m_thread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_cv.notify_all();
+        m_thread.join();
+    }
+    teardown_ring();
+    if (::close(m_fd) != 0)
+    {
+        m_failed = true;
+    }
+    m_fd = -1;
+    return !m_failed;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+
+// Sequential file writer with a fixed pool of preallocated, page aligned buffers.
+// Filled buffers are submitted through io_uring and handed back once the kernel completed the write.
+// Where io_uring is unavailable (old kernels, seccomp in containers) a single writer thread issues
+// pwrite() instead, so the caller never blocks on disk I/O unless all buffers are in flight.
+// With direct_io the file is opened with O_DIRECT, buffer lengths and offsets must then be multiples
+// of alignment.
+class AsyncWriter
+{
+public:
+    static const size_t alignment = 4096;
+
+    AsyncWriter(size_t buffer_size, size_t buffer_count, bool direct_io);
+    ~AsyncWriter();
+    AsyncWriter(const AsyncWriter &) = delete;
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+    bool open(const std::string &path);
+
+    size_t buffer_size() const
+    {
+        return m_buffer_size;
+    }
+
+    // Returns a free buffer of buffer_size() bytes, waits for an in-flight write if all are busy.
+    // Returns nullptr once a write has failed.
+    uint8_t *acquire();
+
+    // Queue an acquired buffer for writing at offset, ownership returns to the pool on completion.
+    bool submit(uint8_t *buffer, size_t length, uint64_t offset);
+
+    // Wait until all submitted writes completed, false if any of them failed.
+    bool drain();
+
+    bool close();
+
+    bool failed() const
+    {
+        return m_failed;
+    }
+
+    bool using_io_uring() const
+    {
+        return m_ring_fd >= 0;
+    }
+
+private:
+    struct Slot
+    {
+        uint8_t *data;
+        size_t length;
+        uint64_t offset;
+        bool busy;
+        // IORING_OP_WRITEV reads the iovec at submission, it lives with the slot
+        struct iovec iov;
+    };
+
+    bool setup_ring(unsigned entries);
+    void teardown_ring();
+    bool ring_submit(size_t slot);
+    // reap completions, blocks for at least one if wait is set
+    bool ring_reap(bool wait);
+    // io_uring_enter failed, fail the writer so acquire() and drain() stop waiting for the ring
+    void ring_failed(int error);
+
+    void thread_main();
+    void complete(size_t slot, int64_t result);
+
+    size_t m_buffer_size;
+    bool m_direct_io;
+    int m_fd = -1;
+    std::vector<Slot> m_slots;
+    size_t m_in_flight = 0;
+    bool m_failed = false;
+
+    // io_uring state
+    int m_ring_fd = -1;
+    void *m_sq_ptr = nullptr;
+    size_t m_sq_size = 0;
+    void *m_cq_ptr = nullptr;
+    size_t m_cq_size = 0;
+    void *m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+    unsigned *m_sq_head = nullptr;
+    unsigned *m_sq_tail = nullptr;
+    unsigned *m_sq_mask = nullptr;
+    unsigned *m_sq_array = nullptr;
+    unsigned *m_cq_head = nullptr;
+    unsigned *m_cq_tail = nullptr;
+    unsigned *m_cq_mask = nullptr;
+    void *m_cqes = nullptr;
+
+    // fallback writer thread
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<size_t> m_queue;
+    bool m_stopping = false;
+};
@@ -0,0 +1,491 @@
+#include "block_summary.h"
+#include "recorder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <fmt/core.h>
+
+namespace fs = std::filesystem;
+
+// IR pixels at or above this level are counted as saturated
+static const uint16_t ir_saturation_level = 65000;
+static const float standard_gravity = 9.80665f;
+
+// Sidecar layout, little endian:
+//   "ATLSUM01", uint32 row count, uint32 column count,
+//   per column: char name[24], uint32 type, uint32 values per row, uint64 file offset of the column data,
+//   followed by the column data. Readers look columns up by name and skip unknown ones.
+static const char summary_magic[8] = {'A', 'T', 'L', 'S', 'U', 'M', '0', '1'};
+
+enum summary_column_type_t : uint32_t
+{
+    SUMMARY_U32 = 0,
+    SUMMARY_U64 = 1,
+    SUMMARY_F32 = 2,
+};
+
+struct summary_column_t
+{
+    const char *name;
+    summary_column_type_t type;
+    uint32_t width;
+    size_t row_offset;
+};
+
+static const summary_column_t summary_columns[] = {
+    {"start_usec", SUMMARY_U64, 1, offsetof(summary_row_t, start_usec)},
+    {"frames", SUMMARY_U32, 1, offsetof(summary_row_t, frames)},
+    {"depth_valid_ratio", SUMMARY_F32, 1, offsetof(summary_row_t, depth_valid_ratio)},
+    {"depth_histogram", SUMMARY_U32, summary_histogram_bins, offsetof(summary_row_t, depth_histogram)},
+    {"depth_motion_mm", SUMMARY_F32, 1, offsetof(summary_row_t, depth_motion_mm)},
+    {"ir_saturation", SUMMARY_F32, 1, offsetof(summary_row_t, ir_saturation)},
+    {"imu_acc_deviation", SUMMARY_F32, 1, offsetof(summary_row_t, imu_acc_deviation)},
+    {"imu_gyro_magnitude", SUMMARY_F32, 1, offsetof(summary_row_t, imu_gyro_magnitude)},
+    {"exposure_usec", SUMMARY_U32, 1, offsetof(summary_row_t, exposure_usec)},
+    {"iso_speed", SUMMARY_U32, 1, offsetof(summary_row_t, iso_speed)},
+};
+
+static const size_t summary_column_name_size = 24;
+static const size_t summary_directory_entry_size = summary_column_name_size + 4 + 4 + 8;
+
+static size_t column_value_size(uint32_t type)
+{
+    return type == SUMMARY_U64 ? 8 : 4;
+}
+
+// The pixel kernels below are kept branch free so the compiler can vectorize them.
+
+static uint64_t count_nonzero(const uint16_t *pixels, size_t count)
+{
+    uint64_t result = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        result += pixels[i] != 0;
+    }
+    return result;
+}
+
+static uint64_t count_at_least(const uint16_t *pixels, size_t count, uint16_t level)
+{
+    uint64_t result = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        result += pixels[i] >= level;
+    }
+    return result;
+}
+
+// sum of absolute differences over pixels that are valid in both frames
+static void depth_difference(const uint16_t *current,
+                             const uint16_t *previous,
+                             size_t count,
+                             uint64_t &sum,
+                             uint64_t &valid)
+{
+    uint64_t local_sum = 0;
+    uint64_t local_valid = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t both = (current[i] != 0) & (previous[i] != 0);
+        int32_t difference = static_cast<int32_t>(current[i]) - static_cast<int32_t>(previous[i]);
+        local_sum += both * static_cast<uint32_t>(difference < 0 ? -difference : difference);
+        local_valid += both;
+    }
+    sum = local_sum;
+    valid = local_valid;
+}
+
+static void depth_histogram(const uint16_t *pixels, size_t count, uint32_t *histogram)
+{
+    // invalid pixels go to an extra bin that is dropped
+    uint32_t bins[summary_histogram_bins + 1] = {};
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint32_t bin = std::min<uint32_t>(pixels[i] / summary_histogram_bin_mm, summary_histogram_bins - 1);
+        bins[pixels[i] == 0 ? summary_histogram_bins : bin]++;
+    }
+    for (int i = 0; i < summary_histogram_bins; ++i)
+    {
+        histogram[i] += bins[i];
+    }
+}
+
+BlockSummarizer::BlockSummarizer()
+{
+    m_thread = std::thread(&BlockSummarizer::run, this);
+}
+
+BlockSummarizer::~BlockSummarizer()
+{
+    if (m_thread.joinable())
+    {
+        finish(std::string());
+    }
+}
+
+void BlockSummarizer::add_capture(k4a_capture_t capture)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queued_captures >= queue_limit)
+        {
+            ++recording_stats.frames_not_summarized;
+            return;
+        }
+        k4a_capture_reference(capture);
+        m_queue.push_back(Item{capture, {}});
+        ++m_queued_captures;
+    }
+    m_cv.notify_one();
+}
+
+void BlockSummarizer::add_imu_sample(const k4a_imu_sample_t &sample)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queued_imu_samples >= imu_queue_limit)
+        {
+            ++recording_stats.imu_samples_not_summarized;
+            return;
+        }
+        m_queue.push_back(Item{nullptr, sample});
+        ++m_queued_imu_samples;
+    }
+    m_cv.notify_one();
+}
+
+void BlockSummarizer::run()
+{
+    while (true)
+    {
+        Item item;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return !m_queue.empty() || m_stopping; });
+            if (m_queue.empty())
+            {
+                return;
+            }
+            item = m_queue.front();
+            m_queue.pop_front();
+            if (item.capture != nullptr)
+            {
+                --m_queued_captures;
+            }
+            else
+            {
+                --m_queued_imu_samples;
+            }
+        }
+        if (item.capture != nullptr)
+        {
+            summarize_capture(item.capture);
+            k4a_capture_release(item.capture);
+        }
+        else
+        {
+            summarize_imu(item.imu);
+        }
+    }
+}
+
+BlockSummarizer::Accumulator &BlockSummarizer::accumulator(uint64_t timestamp_usec)
+{
+    if (m_start_usec < 0)
+    {
+        m_start_usec = static_cast<int64_t>(timestamp_usec);
+    }
+    int64_t offset = std::max<int64_t>(static_cast<int64_t>(timestamp_usec) - m_start_usec, 0);
+    Accumulator &accumulator = m_seconds[static_cast<uint64_t>(offset / 1000000)];
+    if (accumulator.row.start_usec == 0 || timestamp_usec < accumulator.row.start_usec)
+    {
+        accumulator.row.start_usec = timestamp_usec;
+    }
+    return accumulator;
+}
+
+void BlockSummarizer::summarize_capture(k4a_capture_t capture)
+{
+    k4a_image_t color = k4a_capture_get_color_image(capture);
+    k4a_image_t depth = k4a_capture_get_depth_image(capture);
+    k4a_image_t ir = k4a_capture_get_ir_image(capture);
+
+    k4a_image_t first = color != nullptr ? color : depth != nullptr ? depth : ir;
+    if (first != nullptr)
+    {
+        Accumulator &second = accumulator(k4a_image_get_device_timestamp_usec(first));
+        ++second.row.frames;
+
+        if (color != nullptr)
+        {
+            second.row.exposure_usec = static_cast<uint32_t>(k4a_image_get_exposure_usec(color));
+            second.row.iso_speed = k4a_image_get_iso_speed(color);
+        }
+        if (depth != nullptr)
+        {
+            const uint16_t *pixels = reinterpret_cast<const uint16_t *>(k4a_image_get_buffer(depth));
+            size_t count = k4a_image_get_size(depth) / sizeof(uint16_t);
+            second.depth_pixels += count;
+            second.depth_valid += count_nonzero(pixels, count);
+            depth_histogram(pixels, count, second.row.depth_histogram);
+            if (m_previous_depth.size() == count)
+            {
+                uint64_t sum, valid;
+                depth_difference(pixels, m_previous_depth.data(), count, sum, valid);
+                if (valid > 0)
+                {
+                    second.depth_motion += static_cast<double>(sum) / valid;
+                    ++second.depth_motion_frames;
+                }
+            }
+            m_previous_depth.assign(pixels, pixels + count);
+        }
+        if (ir != nullptr)
+        {
+            const uint16_t *pixels = reinterpret_cast<const uint16_t *>(k4a_image_get_buffer(ir));
+            size_t count = k4a_image_get_size(ir) / sizeof(uint16_t);
+            second.ir_pixels += count;
+            second.ir_saturated += count_at_least(pixels, count, ir_saturation_level);
+        }
+    }
+
+    for (k4a_image_t image : {color, depth, ir})
+    {
+        if (image != nullptr)
+        {
+            k4a_image_release(image);
+        }
+    }
+}
+
+void BlockSummarizer::summarize_imu(const k4a_imu_sample_t &sample)
+{
+    Accumulator &second = accumulator(sample.acc_timestamp_usec);
+    const float *acc = sample.acc_sample.v;
+    const float *gyro = sample.gyro_sample.v;
+    float acc_magnitude = std::sqrt(acc[0] * acc[0] + acc[1] * acc[1] + acc[2] * acc[2]);
+    second.acc_deviation += std::fabs(acc_magnitude - standard_gravity);
+    second.gyro_magnitude += std::sqrt(gyro[0] * gyro[0] + gyro[1] * gyro[1] + gyro[2] * gyro[2]);
+    ++second.imu_samples;
+}
+
+bool BlockSummarizer::finish(const std::string &path)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+
+    if (path.empty())
+    {
+        return true;
+    }
+
+    std::vector<summary_row_t> rows;
+    rows.reserve(m_seconds.size());
+    for (auto &[second, accumulator] : m_seconds)
+    {
+        summary_row_t row = accumulator.row;
+        if (accumulator.depth_pixels > 0)
+        {
+            row.depth_valid_ratio = static_cast<float>(accumulator.depth_valid) / accumulator.depth_pixels;
+        }
+        if (accumulator.depth_motion_frames > 0)
+        {
+            row.depth_motion_mm = static_cast<float>(accumulator.depth_motion / accumulator.depth_motion_frames);
+        }
+        if (accumulator.ir_pixels > 0)
+        {
+            row.ir_saturation = static_cast<float>(accumulator.ir_saturated) / accumulator.ir_pixels;
+        }
+        if (accumulator.imu_samples > 0)
+        {
+            row.imu_acc_deviation = static_cast<float>(accumulator.acc_deviation / accumulator.imu_samples);
+            row.imu_gyro_magnitude = static_cast<float>(accumulator.gyro_magnitude / accumulator.imu_samples);
+        }
+        rows.push_back(row);
+    }
+    return write_block_summary(path, rows);
+}
+
+bool write_block_summary(const std::string &path, const std::vector<summary_row_t> &rows)
+{
+    const uint32_t row_count = static_cast<uint32_t>(rows.size());
+    const uint32_t column_count = sizeof(summary_columns) / sizeof(summary_columns[0]);
+
+    std::vector<uint8_t> data;
+    auto append = [&data](const void *value, size_t size) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(value);
+        data.insert(data.end(), bytes, bytes + size);
+    };
+    append(summary_magic, sizeof(summary_magic));
+    append(&row_count, sizeof(row_count));
+    append(&column_count, sizeof(column_count));
+
+    uint64_t offset = data.size() + column_count * summary_directory_entry_size;
+    for (const auto &column : summary_columns)
+    {
+        char name[summary_column_name_size] = {};
+        std::strncpy(name, column.name, sizeof(name) - 1);
+        uint32_t type = column.type;
+        append(name, sizeof(name));
+        append(&type, sizeof(type));
+        append(&column.width, sizeof(column.width));
+        append(&offset, sizeof(offset));
+        offset += uint64_t(row_count) * column.width * column_value_size(column.type);
+    }
+    for (const auto &column : summary_columns)
+    {
+        size_t size = column.width * column_value_size(column.type);
+        for (const auto &row : rows)
+        {
+            append(reinterpret_cast<const uint8_t *>(&row) + column.row_offset, size);
+        }
+    }
+
+    // write to a temporary name so a summary is either complete or missing
+    std::string tmp_path = path + ".part";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+        if (!out)
+        {
+            std::cerr << "Unable to write block summary: " << tmp_path << std::endl;
+            return false;
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    if (ec)
+    {
+        std::cerr << "Unable to rename block summary " << tmp_path << ": " << ec.message() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool read_block_summary(const std::string &path, std::vector<summary_row_t> &rows)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(summary_magic) + 8 || std::memcmp(data.data(), summary_magic, sizeof(summary_magic)) != 0)
+    {
+        return false;
+    }
+    uint32_t row_count, column_count;
+    std::memcpy(&row_count, &data[8], sizeof(row_count));
+    std::memcpy(&column_count, &data[12], sizeof(column_count));
+    if (data.size() < 16 + uint64_t(column_count) * summary_directory_entry_size)
+    {
+        return false;
+    }
+
+    // locate the known columns first, a row_count their data could not hold is rejected before allocating
+    std::vector<std::pair<const summary_column_t *, uint64_t>> found;
+    for (uint32_t i = 0; i < column_count; ++i)
+    {
+        const uint8_t *entry = &data[16 + i * summary_directory_entry_size];
+        std::string name(reinterpret_cast<const char *>(entry),
+                         strnlen(reinterpret_cast<const char *>(entry), summary_column_name_size));
+        uint32_t type, width;
+        uint64_t offset;
+        std::memcpy(&type, entry + summary_column_name_size, sizeof(type));
+        std::memcpy(&width, entry + summary_column_name_size + 4, sizeof(width));
+        std::memcpy(&offset, entry + summary_column_name_size + 8, sizeof(offset));
+
+        for (const auto &column : summary_columns)
+        {
+            if (name == column.name && type == column.type && width == column.width)
+            {
+                uint64_t size = uint64_t(column.width) * column_value_size(column.type);
+                if (offset > data.size() || uint64_t(row_count) * size > data.size() - offset)
+                {
+                    return false;
+                }
+                found.emplace_back(&column, offset);
+            }
+        }
+    }
+    if (row_count > 0 && found.empty())
+    {
+        return false;
+    }
+
+    rows.assign(row_count, summary_row_t());
+    for (const auto &[column, offset] : found)
+    {
+        size_t size = column->width * column_value_size(column->type);
+        for (uint32_t r = 0; r < row_count; ++r)
+        {
+            std::memcpy(reinterpret_cast<uint8_t *>(&rows[r]) + column->row_offset, &data[offset + r * size], size);
+        }
+    }
+    return true;
+}
+
+int triage_summaries(const std::string &dir)
+{
+    std::vector<fs::path> paths;
+    for (const auto &entry : fs::directory_iterator(dir))
+    {
+        if (entry.path().extension() == block_summary_extension)
+        {
+            paths.push_back(entry.path());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty())
+    {
+        std::cerr << "No block summaries found in " << dir << std::endl;
+        return 1;
+    }
+
+    // seconds are flagged when any of these is exceeded
+    const float motion_threshold_mm = 20.0f;
+    const float saturation_threshold = 0.01f;
+    const float valid_depth_threshold = 0.5f;
+    const float gyro_threshold = 0.5f;
+
+    int failures = 0;
+    std::cout << fmt::format("{:<28} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10}", "block", "seconds", "motion",
+                             "saturated", "low depth", "moving", "exposure")
+              << std::endl;
+    for (const auto &path : paths)
+    {
+        std::vector<summary_row_t> rows;
+        std::string name = path.stem().string();
+        if (!read_block_summary(path.string(), rows))
+        {
+            std::cout << fmt::format("{:<28} UNREADABLE", name) << std::endl;
+            ++failures;
+            continue;
+        }
+        size_t motion = 0, saturated = 0, low_depth = 0, moving = 0;
+        uint32_t min_exposure = UINT32_MAX, max_exposure = 0;
+        for (const auto &row : rows)
+        {
+            motion += row.depth_motion_mm > motion_threshold_mm;
+            saturated += row.ir_saturation > saturation_threshold;
+            low_depth += row.frames > 0 && row.depth_valid_ratio < valid_depth_threshold;
+            moving += row.imu_gyro_magnitude > gyro_threshold;
+            if (row.exposure_usec > 0)
+            {
+                min_exposure = std::min(min_exposure, row.exposure_usec);
+                max_exposure = std::max(max_exposure, row.exposure_usec);
+            }
+        }
+        std::string exposure = max_exposure == 0 ? "-" : fmt::format("{}-{}", min_exposure, max_exposure);
+        std::cout << fmt::format("{:<28} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10}", name, rows.size(), motion,
+                                 saturated, low_depth, moving, exposure)
+                  << std::endl;
+    }
+    return failures;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <k4a/k4a.h>
+
+// Extension of the per-block content summary sidecar, written next to the block as "<block>.summary".
+static const char *const block_summary_extension = ".summary";
+
+static const int summary_histogram_bins = 16;
+// depth histogram bin width, the last bin collects everything beyond
+static const uint32_t summary_histogram_bin_mm = 500;
+
+// Content statistics for one second of a block.
+struct summary_row_t
+{
+    // device time of the first frame in this second
+    uint64_t start_usec = 0;
+    uint32_t frames = 0;
+    // fraction of depth pixels with a valid measurement
+    float depth_valid_ratio = 0;
+    // valid depth pixels per distance bin, summed over all frames
+    uint32_t depth_histogram[summary_histogram_bins] = {};
+    // mean absolute depth change in mm between consecutive frames, over pixels valid in both
+    float depth_motion_mm = 0;
+    // fraction of IR pixels at the top of the 16 bit range
+    float ir_saturation = 0;
+    // mean deviation of the accelerometer magnitude from 1g in m/s^2
+    float imu_acc_deviation = 0;
+    // mean gyroscope magnitude in rad/s
+    float imu_gyro_magnitude = 0;
+    // color exposure and ISO speed reported with the last color frame of this second
+    uint32_t exposure_usec = 0;
+    uint32_t iso_speed = 0;
+};
+
+// Computes per-second content statistics of a block on a worker thread and writes them as a columnar
+// sidecar, so recordings can be triaged without decoding the blocks.
+// The capture thread only takes a reference on the capture. When the worker falls behind by more than
+// queue_limit captures new ones are skipped and counted in recording_stats.frames_not_summarized, IMU
+// samples beyond imu_queue_limit in recording_stats.imu_samples_not_summarized.
+class BlockSummarizer
+{
+public:
+    static const size_t queue_limit = 8;
+    // the IMU delivers about 53 samples per frame at 30 fps, this covers the same queue_limit frames
+    static const size_t imu_queue_limit = 512;
+
+    BlockSummarizer();
+    ~BlockSummarizer();
+    BlockSummarizer(const BlockSummarizer &) = delete;
+    BlockSummarizer &operator=(const BlockSummarizer &) = delete;
+
+    void add_capture(k4a_capture_t capture);
+    void add_imu_sample(const k4a_imu_sample_t &sample);
+
+    // Summarize what is still queued and write the sidecar to path, an empty path discards the summary.
+    bool finish(const std::string &path);
+
+private:
+    struct Item
+    {
+        k4a_capture_t capture;
+        k4a_imu_sample_t imu;
+    };
+
+    struct Accumulator
+    {
+        summary_row_t row;
+        uint64_t depth_pixels = 0;
+        uint64_t depth_valid = 0;
+        double depth_motion = 0;
+        uint32_t depth_motion_frames = 0;
+        uint64_t ir_pixels = 0;
+        uint64_t ir_saturated = 0;
+        double acc_deviation = 0;
+        double gyro_magnitude = 0;
+        uint32_t imu_samples = 0;
+    };
+
+    void run();
+    Accumulator &accumulator(uint64_t timestamp_usec);
+    void summarize_capture(k4a_capture_t capture);
+    void summarize_imu(const k4a_imu_sample_t &sample);
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Item> m_queue;
+    size_t m_queued_captures = 0;
+    size_t m_queued_imu_samples = 0;
+    bool m_stopping = false;
+
+    // worker state
+    int64_t m_start_usec = -1;
+    std::map<uint64_t, Accumulator> m_seconds;
+    std::vector<uint16_t> m_previous_depth;
+};
+
+bool write_block_summary(const std::string &path, const std::vector<summary_row_t> &rows);
+bool read_block_summary(const std::string &path, std::vector<summary_row_t> &rows);
+
+// Print a one line digest per block from the summaries in dir, returns the number of unreadable summaries.
+int triage_summaries(const std::string &dir);
@@ -0,0 +1,184 @@
+#include "block_writer.h"
+#include "mkv_writer.h"
+#include "recorder.h"
+#include "stream_filter.h"
+
+#include <cstring>
+
+#include <fmt/core.h>
+
+K4aRecordWriter::~K4aRecordWriter()
+{
+    close();
+}
+
+k4a_result_t K4aRecordWriter::open(const std::string &path,
+                                   k4a_device_t device,
+                                   const k4a_device_configuration_t &config,
+                                   const device_info_t &device_info)
+{
+    if (device_info.raw_calibration.empty())
+    {
+        return k4a_record_create(path.c_str(), device, config, &m_recording);
+    }
+
+    k4a_result_t result = k4a_record_create(path.c_str(), nullptr, config, &m_recording);
+    if (K4A_FAILED(result))
+    {
+        return result;
+    }
+    // same attachment and tags k4arecord writes for a device, the raw calibration is NUL terminated
+    size_t size = device_info.raw_calibration.size();
+    while (size > 0 && device_info.raw_calibration[size - 1] == 0)
+    {
+        --size;
+    }
+    const k4a_hardware_version_t &version = device_info.version;
+    std::string color_firmware = fmt::format("{}.{}.{}", version.rgb.major, version.rgb.minor, version.rgb.iteration);
+    std::string depth_firmware =
+        fmt::format("{}.{}.{}", version.depth.major, version.depth.minor, version.depth.iteration);
+    result = k4a_record_add_attachment(m_recording, "calibration.json", device_info.raw_calibration.data(), size);
+    if (K4A_SUCCEEDED(result))
+    {
+        result = add_tag("K4A_CALIBRATION_FILE", "calibration.json");
+    }
+    if (K4A_SUCCEEDED(result))
+    {
+        result = add_tag("K4A_COLOR_FIRMWARE_VERSION", color_firmware.c_str());
+    }
+    if (K4A_SUCCEEDED(result))
+    {
+        result = add_tag("K4A_DEPTH_FIRMWARE_VERSION", depth_firmware.c_str());
+    }
+    if (K4A_SUCCEEDED(result) && !device_info.serial_number.empty())
+    {
+        result = add_tag("K4A_DEVICE_SERIAL_NUMBER", device_info.serial_number.c_str());
+    }
+    if (K4A_FAILED(result))
+    {
+        close();
+    }
+    return result;
+}
+
+k4a_result_t K4aRecordWriter::add_tag(const char *name, const char *value)
+{
+    return k4a_record_add_tag(m_recording, name, value);
+}
+
+k4a_result_t K4aRecordWriter::add_imu_track()
+{
+    return k4a_record_add_imu_track(m_recording);
+}
+
+k4a_result_t K4aRecordWriter::add_custom_video_track(const char *track_name,
+                                                     const char *codec_id,
+                                                     const uint8_t *codec_context,
+                                                     size_t codec_context_size,
+                                                     const k4a_record_video_settings_t *track_settings)
+{
+    return k4a_record_add_custom_video_track(m_recording, track_name, codec_id, codec_context, codec_context_size,
+                                             track_settings);
+}
+
+k4a_result_t K4aRecordWriter::add_custom_subtitle_track(const char *track_name,
+                                                        const char *codec_id,
+                                                        const uint8_t *codec_context,
+                                                        size_t codec_context_size,
+                                                        const k4a_record_subtitle_settings_t *track_settings)
+{
+    return k4a_record_add_custom_subtitle_track(m_recording, track_name, codec_id, codec_context, codec_context_size,
+                                                track_settings);
+}
+
+k4a_result_t K4aRecordWriter::write_header()
+{
+    return k4a_record_write_header(m_recording);
+}
+
+k4a_result_t K4aRecordWriter::write_capture(k4a_capture_t capture)
+{
+    return k4a_record_write_capture(m_recording, capture);
+}
+
+k4a_result_t K4aRecordWriter::write_imu_sample(k4a_imu_sample_t imu_sample)
+{
+    return k4a_record_write_imu_sample(m_recording, imu_sample);
+}
+
+k4a_result_t K4aRecordWriter::write_custom_track_data(const char *track_name,
+                                                      uint64_t device_timestamp_usec,
+                                                      uint8_t *custom_data,
+                                                      size_t custom_data_size)
+{
+    return k4a_record_write_custom_track_data(m_recording, track_name, device_timestamp_usec, custom_data,
+                                              custom_data_size);
+}
+
+k4a_result_t K4aRecordWriter::flush()
+{
+    return k4a_record_flush(m_recording);
+}
+
+k4a_result_t K4aRecordWriter::close()
+{
+    // k4a_record_close() has no result, a failed write shows in the preceding flush()
+    if (m_recording != nullptr)
+    {
+        k4a_record_close(m_recording);
+        m_recording = nullptr;
+    }
+    return K4A_RESULT_SUCCEEDED;
+}
+
+std::vector<uint8_t> bitmap_info_header(uint32_t width, uint32_t height, uint16_t bit_count, const char *fourcc)
+{
+    std::vector<uint8_t> header(40, 0);
+    auto put_le = [&](size_t pos, uint32_t value, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i)
+        {
+            header[pos + i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    };
+    put_le(0, 40, 4);
+    put_le(4, width, 4);
+    put_le(8, height, 4);
+    put_le(12, 1, 2);
+    put_le(14, bit_count, 2);
+    std::memcpy(&header[16], fourcc, 4);
+    put_le(20, width * height * bit_count / 8, 4);
+    return header;
+}
+
+std::unique_ptr<BlockWriter> create_block_writer(const std::string &path,
+                                                 k4a_device_t device,
+                                                 const k4a_device_configuration_t &config,
+                                                 const recording_options_t &options,
+                                                 const device_info_t &device_info)
+{
+    k4a_device_configuration_t writer_config = writer_configuration(config, options);
+    if (options.native_writer)
+    {
+        size_t extra_frame_size = roi_frame_size(config, options);
+        if (options.registered_depth)
+        {
+            int width, height;
+            k4a_color_resolution_to_size(config.color_resolution, width, height);
+            extra_frame_size += static_cast<size_t>(width) * height * sizeof(uint16_t);
+        }
+        auto writer =
+            std::make_unique<NativeMkvWriter>(writer_config, device_info, options.direct_io, extra_frame_size);
+        if (!writer->open(path))
+        {
+            return nullptr;
+        }
+        return writer;
+    }
+
+    auto writer = std::make_unique<K4aRecordWriter>();
+    if (K4A_FAILED(writer->open(path, device, writer_config, device_info)))
+    {
+        return nullptr;
+    }
+    return writer;
+}
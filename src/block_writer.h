@@ -0,0 +1,94 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <k4a/k4a.h>
+#include <k4arecord/record.h>
+
+struct recording_options_t;
+struct device_info_t;
+
+// Writes one recording block. Mirrors the k4arecord record API so the recorder can switch between
+// libk4arecord and the native streaming writer (mkv_writer.h) without caring which one is in use.
+class BlockWriter
+{
+public:
+    virtual ~BlockWriter() = default;
+
+    virtual k4a_result_t add_tag(const char *name, const char *value) = 0;
+    virtual k4a_result_t add_imu_track() = 0;
+    virtual k4a_result_t add_custom_video_track(const char *track_name,
+                                                const char *codec_id,
+                                                const uint8_t *codec_context,
+                                                size_t codec_context_size,
+                                                const k4a_record_video_settings_t *track_settings) = 0;
+    virtual k4a_result_t add_custom_subtitle_track(const char *track_name,
+                                                   const char *codec_id,
+                                                   const uint8_t *codec_context,
+                                                   size_t codec_context_size,
+                                                   const k4a_record_subtitle_settings_t *track_settings) = 0;
+    virtual k4a_result_t write_header() = 0;
+
+    virtual k4a_result_t write_capture(k4a_capture_t capture) = 0;
+    virtual k4a_result_t write_imu_sample(k4a_imu_sample_t imu_sample) = 0;
+    virtual k4a_result_t write_custom_track_data(const char *track_name,
+                                                 uint64_t device_timestamp_usec,
+                                                 uint8_t *custom_data,
+                                                 size_t custom_data_size) = 0;
+
+    virtual k4a_result_t flush() = 0;
+    // Finish the file, fails if the data written so far could not be completed into a valid block.
+    virtual k4a_result_t close() = 0;
+};
+
+// BlockWriter on top of libk4arecord.
+class K4aRecordWriter : public BlockWriter
+{
+public:
+    ~K4aRecordWriter() override;
+
+    // With a calibration in device_info the block is created without the device and the calibration
+    // attachment, serial number and firmware tags are written from device_info, so that k4arecord does
+    // not query the device again for every block.
+    k4a_result_t open(const std::string &path,
+                      k4a_device_t device,
+                      const k4a_device_configuration_t &config,
+                      const device_info_t &device_info);
+
+    k4a_result_t add_tag(const char *name, const char *value) override;
+    k4a_result_t add_imu_track() override;
+    k4a_result_t add_custom_video_track(const char *track_name,
+                                        const char *codec_id,
+                                        const uint8_t *codec_context,
+                                        size_t codec_context_size,
+                                        const k4a_record_video_settings_t *track_settings) override;
+    k4a_result_t add_custom_subtitle_track(const char *track_name,
+                                           const char *codec_id,
+                                           const uint8_t *codec_context,
+                                           size_t codec_context_size,
+                                           const k4a_record_subtitle_settings_t *track_settings) override;
+    k4a_result_t write_header() override;
+    k4a_result_t write_capture(k4a_capture_t capture) override;
+    k4a_result_t write_imu_sample(k4a_imu_sample_t imu_sample) override;
+    k4a_result_t write_custom_track_data(const char *track_name,
+                                         uint64_t device_timestamp_usec,
+                                         uint8_t *custom_data,
+                                         size_t custom_data_size) override;
+    k4a_result_t flush() override;
+    k4a_result_t close() override;
+
+private:
+    k4a_record_t m_recording = nullptr;
+};
+
+// BITMAPINFOHEADER used as CodecPrivate of V_MS/VFW/FOURCC video tracks
+std::vector<uint8_t> bitmap_info_header(uint32_t width, uint32_t height, uint16_t bit_count, const char *fourcc);
+
+// Create and open the writer selected in options, nullptr if the file could not be created.
+std::unique_ptr<BlockWriter> create_block_writer(const std::string &path,
+                                                 k4a_device_t device,
+                                                 const k4a_device_configuration_t &config,
+                                                 const recording_options_t &options,
+                                                 const device_info_t &device_info);
@@ -0,0 +1,214 @@
+#include "checksum.h"
+
+#include <atomic>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <fmt/core.h>
+#include <xxhash.h>
+
+namespace fs = std::filesystem;
+
+// blocks are several GB, read them in chunks large enough to keep the disk streaming
+static const size_t hash_chunk_size = 8 * 1024 * 1024;
+
+static std::mutex manifest_mutex;
+
+BlockHasher::BlockHasher() : m_state(XXH3_createState())
+{
+    XXH3_64bits_reset(m_state);
+}
+
+BlockHasher::~BlockHasher()
+{
+    XXH3_freeState(m_state);
+}
+
+void BlockHasher::update(const void *data, size_t size)
+{
+    XXH3_64bits_update(m_state, data, size);
+}
+
+uint64_t BlockHasher::digest() const
+{
+    return XXH3_64bits_digest(m_state);
+}
+
+bool hash_file(const std::string &path, uint64_t &digest)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+    {
+        return false;
+    }
+
+    BlockHasher hasher;
+    std::vector<char> buffer(hash_chunk_size);
+    while (file)
+    {
+        file.read(buffer.data(), buffer.size());
+        hasher.update(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+    if (file.bad())
+    {
+        return false;
+    }
+    digest = hasher.digest();
+    return true;
+}
+
+std::string format_digest(uint64_t digest)
+{
+    return fmt::format("{:016x}", digest);
+}
+
+bool append_manifest_entry(const std::string &dir, const std::string &block_name, uint64_t digest)
+{
+    std::lock_guard<std::mutex> lock(manifest_mutex);
+    std::ofstream manifest((fs::path(dir) / checksum_manifest_name).string(), std::ios::app);
+    if (!manifest.is_open())
+    {
+        return false;
+    }
+    manifest << format_digest(digest) << "  " << block_name << std::endl;
+    return manifest.good();
+}
+
+bool remove_manifest_entry(const std::string &dir, const std::string &block_name)
+{
+    // finalizers append under the same mutex, so no entry is lost while the manifest is rewritten
+    std::lock_guard<std::mutex> lock(manifest_mutex);
+    fs::path manifest_path = fs::path(dir) / checksum_manifest_name;
+    std::ifstream manifest(manifest_path.string());
+    if (!manifest.is_open())
+    {
+        return false;
+    }
+    std::string kept;
+    std::string line;
+    bool found = false;
+    while (std::getline(manifest, line))
+    {
+        std::istringstream entry(line);
+        std::string digest, name;
+        entry >> digest;
+        std::getline(entry >> std::ws, name);
+        if (name == block_name)
+        {
+            found = true;
+            continue;
+        }
+        kept += line + "\n";
+    }
+    manifest.close();
+    if (!found)
+    {
+        return true;
+    }
+
+    fs::path part_path = manifest_path.string() + ".tmp";
+    {
+        std::ofstream part(part_path.string(), std::ios::trunc);
+        part << kept;
+        if (!part.flush())
+        {
+            return false;
+        }
+    }
+    std::error_code error;
+    fs::rename(part_path, manifest_path, error);
+    return !error;
+}
+
+int verify_manifest(const std::string &dir, unsigned num_threads)
+{
+    fs::path manifest_path = fs::path(dir) / checksum_manifest_name;
+    std::ifstream manifest(manifest_path.string());
+    if (!manifest.is_open())
+    {
+        std::cerr << "No checksum manifest found: " << manifest_path.string() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> entries;
+    int malformed = 0;
+    size_t line_number = 0;
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        ++line_number;
+        if (line.empty())
+        {
+            continue;
+        }
+        std::istringstream entry(line);
+        std::string digest, name;
+        entry >> digest;
+        // block names may contain spaces, take the remainder after the two separator blanks
+        std::getline(entry >> std::ws, name);
+        // a crash in the middle of an append leaves a truncated last line, report it and check the rest
+        uint64_t value = 0;
+        auto parsed = std::from_chars(digest.data(), digest.data() + digest.size(), value, 16);
+        if (digest.size() != 16 || parsed.ec != std::errc() || parsed.ptr != digest.data() + digest.size() ||
+            name.empty())
+        {
+            std::cout << manifest_path.string() << ":" << line_number << ": MALFORMED" << std::endl;
+            ++malformed;
+            continue;
+        }
+        entries.emplace_back(name, value);
+    }
+
+    if (num_threads == 0)
+    {
+        num_threads = 1;
+    }
+
+    std::atomic<size_t> next_entry{0};
+    std::atomic<int> failures{malformed};
+    std::mutex output_mutex;
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        workers.emplace_back([&]() {
+            size_t idx;
+            while ((idx = next_entry++) < entries.size())
+            {
+                const auto &[name, expected] = entries[idx];
+                uint64_t actual = 0;
+                std::string status;
+                if (!fs::exists(fs::path(dir) / name))
+                {
+                    status = "MISSING";
+                }
+                else if (!hash_file((fs::path(dir) / name).string(), actual))
+                {
+                    status = "READ ERROR";
+                }
+                else if (actual != expected)
+                {
+                    status = "FAILED";
+                }
+                if (!status.empty())
+                {
+                    ++failures;
+                }
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cout << name << ": " << (status.empty() ? "OK" : status) << std::endl;
+            }
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    std::cout << "Verified " << entries.size() << " blocks, " << failures << " failed." << std::endl;
+    return failures;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+struct XXH3_state_s;
+
+// Name of the per-directory manifest that lists the digest of every finalized block.
+static const char *const checksum_manifest_name = "checksums.xxh3";
+
+// Incremental XXH3-64 digest of a block.
+class BlockHasher
+{
+public:
+    BlockHasher();
+    ~BlockHasher();
+    BlockHasher(const BlockHasher &) = delete;
+    BlockHasher &operator=(const BlockHasher &) = delete;
+
+    void update(const void *data, size_t size);
+    uint64_t digest() const;
+
+private:
+    XXH3_state_s *m_state;
+};
+
+// Hash a file in large sequential reads, returns false if it could not be read.
+bool hash_file(const std::string &path, uint64_t &digest);
+
+std::string format_digest(uint64_t digest);
+
+// Append "<digest>  <block name>" to the manifest in dir. Safe to call from several finalizer threads.
+bool append_manifest_entry(const std::string &dir, const std::string &block_name, uint64_t digest);
+
+// Drop the entries of block_name from the manifest in dir, used once a block has moved elsewhere.
+bool remove_manifest_entry(const std::string &dir, const std::string &block_name);
+
+// Check every block listed in the manifest of dir using num_threads readers, returns the number of failures.
+int verify_manifest(const std::string &dir, unsigned num_threads);
@@ -0,0 +1,272 @@
+#include "depth_registration.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <cstring>
+
+DepthRegistration::DepthRegistration(const k4a_calibration_t &calibration, unsigned threads) :
+    m_depth_width(calibration.depth_camera_calibration.resolution_width),
+    m_depth_height(calibration.depth_camera_calibration.resolution_height),
+    m_color_width(calibration.color_camera_calibration.resolution_width),
+    m_color_height(calibration.color_camera_calibration.resolution_height)
+{
+    const k4a_calibration_extrinsics_t &extrinsics =
+        calibration.extrinsics[K4A_CALIBRATION_TYPE_DEPTH][K4A_CALIBRATION_TYPE_COLOR];
+    const float *rotation = extrinsics.rotation;
+    std::memcpy(m_translation, extrinsics.translation, sizeof(m_translation));
+
+    // the inverse depth distortion has no closed form, let the SDK unproject every pixel once
+    m_rays.assign(static_cast<size_t>(m_depth_width) * m_depth_height * 3, 0.0f);
+    for (int y = 0; y < m_depth_height; ++y)
+    {
+        for (int x = 0; x < m_depth_width; ++x)
+        {
+            k4a_float2_t pixel;
+            pixel.xy.x = static_cast<float>(x);
+            pixel.xy.y = static_cast<float>(y);
+            k4a_float3_t ray;
+            int valid = 0;
+            if (K4A_FAILED(k4a_calibration_2d_to_3d(&calibration, &pixel, 1.0f, K4A_CALIBRATION_TYPE_DEPTH,
+                                                    K4A_CALIBRATION_TYPE_DEPTH, &ray, &valid)) ||
+                !valid)
+            {
+                continue;
+            }
+            float *out = &m_rays[(static_cast<size_t>(y) * m_depth_width + x) * 3];
+            for (int row = 0; row < 3; ++row)
+            {
+                out[row] = rotation[row * 3] * ray.v[0] + rotation[row * 3 + 1] * ray.v[1] +
+                           rotation[row * 3 + 2] * ray.v[2];
+            }
+        }
+    }
+
+    const k4a_calibration_camera_t &color_camera = calibration.color_camera_calibration;
+    const auto &param = color_camera.intrinsics.parameters.param;
+    m_color = {param.cx, param.cy, param.fx, param.fy, param.k1, param.k2, param.k3, param.k4, param.k5,
+               param.k6, param.codx, param.cody, param.p1, param.p2, 0.0f, 2.0f};
+    float max_radius = color_camera.metric_radius > 0 ? color_camera.metric_radius : param.metric_radius;
+    m_color.max_radius_squared = max_radius > 0 ? max_radius * max_radius : INFINITY;
+    // same tangential terms as the SDK projection
+    if (color_camera.intrinsics.type == K4A_CALIBRATION_LENS_DISTORTION_MODEL_RATIONAL_6KT)
+    {
+        m_color.tangential_scale = 1.0f;
+    }
+
+    // a depth pixel covers about fx_color / fx_depth color pixels in each direction
+    float depth_fx = calibration.depth_camera_calibration.intrinsics.parameters.param.fx;
+    m_splat_size = depth_fx > 0 ? std::max(1, static_cast<int>(std::ceil(param.fx / depth_fx))) : 1;
+
+    threads = std::max(1u, threads);
+    m_max_in_flight = threads * 2;
+    m_pool = std::make_unique<ImagePool>(K4A_IMAGE_FORMAT_CUSTOM16, m_color_width, m_color_height,
+                                         m_color_width * 2,
+                                         static_cast<size_t>(m_color_width) * m_color_height * 2,
+                                         m_max_in_flight + 2);
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        m_workers.emplace_back(&DepthRegistration::run, this);
+    }
+}
+
+DepthRegistration::~DepthRegistration()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_work_cv.notify_all();
+    for (auto &worker : m_workers)
+    {
+        worker.join();
+    }
+    for (auto &job : m_jobs)
+    {
+        if (!job->finished)
+        {
+            k4a_image_release(job->depth);
+        }
+        k4a_image_release(job->output);
+    }
+}
+
+bool DepthRegistration::submit(k4a_capture_t capture)
+{
+    k4a_image_t depth = k4a_capture_get_depth_image(capture);
+    if (depth == nullptr)
+    {
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_jobs.size() < m_max_in_flight)
+        {
+            k4a_image_t output = m_pool->create_image();
+            if (output != nullptr)
+            {
+                k4a_image_set_device_timestamp_usec(output, k4a_image_get_device_timestamp_usec(depth));
+                k4a_image_set_system_timestamp_nsec(output, k4a_image_get_system_timestamp_nsec(depth));
+                m_jobs.push_back(std::make_shared<Job>(Job{depth, output, false, false}));
+                depth = nullptr;
+            }
+        }
+    }
+    if (depth != nullptr)
+    {
+        k4a_image_release(depth);
+        return false;
+    }
+    m_work_cv.notify_one();
+    return true;
+}
+
+void DepthRegistration::collect(std::vector<k4a_image_t> &done, bool wait)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_jobs.empty())
+    {
+        if (!m_jobs.front()->finished)
+        {
+            if (!wait)
+            {
+                break;
+            }
+            m_done_cv.wait(lock, [this]() { return m_jobs.front()->finished; });
+        }
+        done.push_back(m_jobs.front()->output);
+        m_jobs.pop_front();
+    }
+}
+
+void DepthRegistration::run()
+{
+    std::vector<uint16_t> scratch(static_cast<size_t>(m_color_width) * m_color_height);
+    std::vector<int32_t> targets(static_cast<size_t>(m_depth_width) * m_depth_height * 2);
+    while (true)
+    {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_work_cv.wait(lock, [&]() {
+                if (m_stopping)
+                {
+                    return true;
+                }
+                for (auto &candidate : m_jobs)
+                {
+                    if (!candidate->started)
+                    {
+                        job = candidate;
+                        return true;
+                    }
+                }
+                return false;
+            });
+            if (!job)
+            {
+                return;
+            }
+            job->started = true;
+        }
+
+        if (static_cast<size_t>(k4a_image_get_size(job->depth)) ==
+            static_cast<size_t>(m_depth_width) * m_depth_height * sizeof(uint16_t))
+        {
+            register_depth(reinterpret_cast<const uint16_t *>(k4a_image_get_buffer(job->depth)),
+                           k4a_image_get_buffer(job->output), scratch, targets);
+        }
+        else
+        {
+            std::memset(k4a_image_get_buffer(job->output), 0, k4a_image_get_size(job->output));
+        }
+        k4a_image_release(job->depth);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            job->finished = true;
+        }
+        m_done_cv.notify_all();
+    }
+}
+
+void DepthRegistration::register_depth(const uint16_t *depth,
+                                       uint8_t *output,
+                                       std::vector<uint16_t> &scratch,
+                                       std::vector<int32_t> &targets)
+{
+    const size_t pixels = static_cast<size_t>(m_depth_width) * m_depth_height;
+    const ColorIntrinsics c = m_color;
+    const float tx = m_translation[0], ty = m_translation[1], tz = m_translation[2];
+    const float *rays = m_rays.data();
+    const int half = (m_splat_size - 1) / 2;
+    int32_t *target_x = targets.data();
+    int32_t *target_y = targets.data() + pixels;
+
+    // projection into the color camera, branch free so it vectorizes
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        float d = depth[i];
+        float x = rays[i * 3] * d + tx;
+        float y = rays[i * 3 + 1] * d + ty;
+        float z = rays[i * 3 + 2] * d + tz;
+        bool valid = depth[i] != 0 && rays[i * 3 + 2] != 0.0f && z > 0.0f;
+        float inverse_z = valid ? 1.0f / z : 0.0f;
+
+        float xp = x * inverse_z - c.codx;
+        float yp = y * inverse_z - c.cody;
+        float xp2 = xp * xp;
+        float yp2 = yp * yp;
+        float xyp = xp * yp;
+        float rs = xp2 + yp2;
+        float rss = rs * rs;
+        float rsc = rss * rs;
+        float a = 1.0f + c.k1 * rs + c.k2 * rss + c.k3 * rsc;
+        float b = 1.0f + c.k4 * rs + c.k5 * rss + c.k6 * rsc;
+        float distortion = b != 0.0f ? a / b : a;
+        float xd = xp * distortion + (rs + 2.0f * xp2) * c.p2 + c.tangential_scale * xyp * c.p1 + c.codx;
+        float yd = yp * distortion + (rs + 2.0f * yp2) * c.p1 + c.tangential_scale * xyp * c.p2 + c.cody;
+        float u = xd * c.fx + c.cx;
+        float v = yd * c.fy + c.cy;
+        valid = valid && rs <= c.max_radius_squared && u >= 0.0f && v >= 0.0f && u < m_color_width - 0.5f &&
+                v < m_color_height - 0.5f;
+
+        // the float to int conversion is undefined for NaN and out of range values of invalid pixels
+        target_x[i] = valid ? static_cast<int32_t>(u + 0.5f) - half : INT32_MIN;
+        target_y[i] = valid ? static_cast<int32_t>(v + 0.5f) - half : 0;
+    }
+
+    // splat with a depth test, the nearest surface wins
+    std::fill(scratch.begin(), scratch.end(), 0);
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        if (target_x[i] == INT32_MIN)
+        {
+            continue;
+        }
+        uint16_t d = depth[i];
+        int x0 = std::max(target_x[i], 0);
+        int y0 = std::max(target_y[i], 0);
+        int x1 = std::min(target_x[i] + m_splat_size, m_color_width);
+        int y1 = std::min(target_y[i] + m_splat_size, m_color_height);
+        for (int y = y0; y < y1; ++y)
+        {
+            uint16_t *row = &scratch[static_cast<size_t>(y) * m_color_width];
+            for (int x = x0; x < x1; ++x)
+            {
+                if (row[x] == 0 || d < row[x])
+                {
+                    row[x] = d;
+                }
+            }
+        }
+    }
+
+    // b16g is big endian
+    const size_t color_pixels = scratch.size();
+    for (size_t i = 0; i < color_pixels; ++i)
+    {
+        output[i * 2] = static_cast<uint8_t>(scratch[i] >> 8);
+        output[i * 2 + 1] = static_cast<uint8_t>(scratch[i]);
+    }
+}
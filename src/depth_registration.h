@@ -0,0 +1,97 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <k4a/k4a.h>
+
+#include "image_pool.h"
+
+// Track names of the registered depth output.
+static const char *const registered_depth_track_name = "REGISTERED_DEPTH";
+// one subtitle block per capture whose depth was not registered because the workers were busy
+static const char *const registered_depth_skipped_track_name = "REGISTERED_DEPTH_SKIPPED";
+
+// Registers depth images to the color camera on a pool of CPU worker threads, like
+// k4a_transformation_depth_image_to_color_camera without a GPU.
+//
+// At construction every depth pixel is unprojected once into a ray in color camera orientation. Per frame
+// a worker scales the rays by the measured depth, applies the depth to color translation, projects with
+// the color intrinsics and splats the depth into the color image, keeping the nearest value.
+// Frames are registered concurrently, one per worker. submit never blocks, when max_in_flight frames are
+// pending the capture is skipped instead. Results are 16 bit big endian ("b16g") images at color
+// resolution, ready to be written to a custom track.
+class DepthRegistration
+{
+public:
+    DepthRegistration(const k4a_calibration_t &calibration, unsigned threads);
+    ~DepthRegistration();
+    DepthRegistration(const DepthRegistration &) = delete;
+    DepthRegistration &operator=(const DepthRegistration &) = delete;
+
+    int width() const
+    {
+        return m_color_width;
+    }
+    int height() const
+    {
+        return m_color_height;
+    }
+
+    // Queue the depth image of capture, false if it was skipped because all workers are busy.
+    bool submit(k4a_capture_t capture);
+
+    // Move finished results to done in submission order, with wait also those still in progress.
+    // Ownership of the images passes to the caller.
+    void collect(std::vector<k4a_image_t> &done, bool wait);
+
+private:
+    struct Job
+    {
+        k4a_image_t depth;
+        k4a_image_t output;
+        bool started;
+        bool finished;
+    };
+
+    struct ColorIntrinsics
+    {
+        float cx, cy, fx, fy;
+        float k1, k2, k3, k4, k5, k6;
+        float codx, cody, p1, p2;
+        float max_radius_squared;
+        float tangential_scale;
+    };
+
+    void run();
+    // scratch holds the native endian result, targets the color pixel of every depth pixel
+    void register_depth(const uint16_t *depth,
+                        uint8_t *output,
+                        std::vector<uint16_t> &scratch,
+                        std::vector<int32_t> &targets);
+
+    int m_depth_width;
+    int m_depth_height;
+    int m_color_width;
+    int m_color_height;
+    // per depth pixel ray rotated into the color camera, x y z interleaved, z = 0 for invalid pixels
+    std::vector<float> m_rays;
+    float m_translation[3];
+    ColorIntrinsics m_color;
+    // side length of the square each depth pixel covers in the color image
+    int m_splat_size;
+    size_t m_max_in_flight;
+
+    std::unique_ptr<ImagePool> m_pool;
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    std::deque<std::shared_ptr<Job>> m_jobs;
+    bool m_stopping = false;
+};
@@ -0,0 +1,76 @@
+#include "device_probe.h"
+
+#include <thread>
+
+namespace
+{
+bool read_raw_calibration(k4a_device_t device, std::vector<uint8_t> &raw)
+{
+    size_t size = 0;
+    if (k4a_device_get_raw_calibration(device, nullptr, &size) != K4A_BUFFER_RESULT_TOO_SMALL)
+    {
+        return false;
+    }
+    raw.resize(size);
+    if (k4a_device_get_raw_calibration(device, raw.data(), &size) != K4A_BUFFER_RESULT_SUCCEEDED)
+    {
+        raw.clear();
+        return false;
+    }
+    raw.resize(size);
+    return true;
+}
+} // namespace
+
+k4a_result_t query_device_info(k4a_device_t device, device_info_t *info)
+{
+    char serial_number_buffer[256];
+    size_t serial_number_buffer_size = sizeof(serial_number_buffer);
+    if (k4a_device_get_serialnum(device, serial_number_buffer, &serial_number_buffer_size) !=
+        K4A_BUFFER_RESULT_SUCCEEDED)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    info->serial_number = serial_number_buffer;
+    if (K4A_FAILED(k4a_device_get_version(device, &info->version)))
+    {
+        return K4A_RESULT_FAILED;
+    }
+
+    // recording without the calibration attachment is still useful, callers only get a warning
+    read_raw_calibration(device, info->raw_calibration);
+    return K4A_RESULT_SUCCEEDED;
+}
+
+std::vector<device_probe_t> probe_devices()
+{
+    uint32_t device_count = k4a_device_get_installed_count();
+    std::vector<device_probe_t> probes(device_count);
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < device_count; ++i)
+    {
+        threads.emplace_back([i, &probe = probes[i]]() {
+            k4a_device_t device;
+            if (K4A_FAILED(k4a_device_open(i, &device)))
+            {
+                return;
+            }
+            probe.opened = true;
+            char serial_number_buffer[256];
+            size_t serial_number_buffer_size = sizeof(serial_number_buffer);
+            if (k4a_device_get_serialnum(device, serial_number_buffer, &serial_number_buffer_size) ==
+                K4A_BUFFER_RESULT_SUCCEEDED)
+            {
+                probe.serial_ok = true;
+                probe.info.serial_number = serial_number_buffer;
+            }
+            probe.version_ok = K4A_SUCCEEDED(k4a_device_get_version(device, &probe.info.version));
+            k4a_device_close(device);
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    return probes;
+}
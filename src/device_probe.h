@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+
+#include <k4a/k4a.h>
+
+#include "recorder.h"
+
+// Serial number, version and raw calibration of an open device. k4a_device_open() already read the
+// calibration from the depth camera, the copy taken here is reused for registration and every block.
+// Fails if serial number or version cannot be read, a missing calibration leaves raw_calibration empty.
+k4a_result_t query_device_info(k4a_device_t device, device_info_t *info);
+
+struct device_probe_t
+{
+    bool opened = false;
+    bool serial_ok = false;
+    bool version_ok = false;
+    device_info_t info;
+};
+
+// Open every installed device on its own thread and read serial number and version, the results are in
+// device index order. Opening a device takes most of a second, probing in parallel keeps --list on a
+// large rig as fast as on a single camera.
+std::vector<device_probe_t> probe_devices();
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "cmdparser.h"
+#include "exporter.h"
+
+int main(int argc, char **argv)
+{
+    export_options_t options;
+    options.threads = std::max(1u, std::thread::hardware_concurrency());
+
+    CmdParser::OptionParser cmd_parser;
+    cmd_parser.RegisterOption("-h|--help", "Prints this help", [&]() {
+        std::cout << "atlas_export [options] <recording dir> <output dir>" << std::endl << std::endl;
+        cmd_parser.PrintOptions();
+        exit(0);
+    });
+    cmd_parser.RegisterOption("--threads",
+                              "Number of worker threads (default: number of cores)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  int threads = std::stoi(args[0]);
+                                  if (threads < 1)
+                                  {
+                                      throw std::runtime_error("Thread count must be positive.");
+                                  }
+                                  options.threads = static_cast<unsigned>(threads);
+                              });
+    cmd_parser.RegisterOption("--streams",
+                              "Streams to export (default: color,depth,ir,imu)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  options.color = options.depth = options.ir = options.imu = false;
+                                  std::istringstream split(args[0]);
+                                  std::string stream;
+                                  while (std::getline(split, stream, ','))
+                                  {
+                                      if (stream == "color")
+                                      {
+                                          options.color = true;
+                                      }
+                                      else if (stream == "depth")
+                                      {
+                                          options.depth = true;
+                                      }
+                                      else if (stream == "ir")
+                                      {
+                                          options.ir = true;
+                                      }
+                                      else if (stream == "imu")
+                                      {
+                                          options.imu = true;
+                                      }
+                                      else
+                                      {
+                                          throw std::runtime_error("Unknown stream specified: " + stream);
+                                      }
+                                  }
+                              });
+    cmd_parser.RegisterOption("--jpeg-quality",
+                              "JPEG quality for color formats other than MJPG, which is copied (default: 90)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  options.jpeg_quality = std::stoi(args[0]);
+                                  if (options.jpeg_quality < 1 || options.jpeg_quality > 100)
+                                  {
+                                      throw std::runtime_error("JPEG quality must be between 1 and 100.");
+                                  }
+                              });
+
+    int args_left = 0;
+    try
+    {
+        args_left = cmd_parser.ParseCmd(argc, argv);
+    }
+    catch (CmdParser::ArgumentError &e)
+    {
+        std::cerr << e.option() << ": " << e.what() << std::endl;
+        return 1;
+    }
+    if (args_left != 2)
+    {
+        std::cout << "atlas_export [options] <recording dir> <output dir>" << std::endl << std::endl;
+        cmd_parser.PrintOptions();
+        return 0;
+    }
+
+    int failed = export_session(argv[argc - 2], argv[argc - 1], options);
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,510 @@
+#include "exporter.h"
+#include "image_codec.h"
+#include "task_pool.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include <fmt/core.h>
+#include <k4a/k4a.h>
+#include <k4arecord/playback.h>
+#include <png.h>
+
+namespace fs = std::filesystem;
+
+// decoded captures a block may hold while its frames are encoded
+static const size_t frames_in_flight_per_block = 8;
+// zlib level 1, depth and IR compress only slightly better at higher levels but take several times longer
+static const int png_compression_level = 1;
+
+namespace
+{
+struct output_file_t
+{
+    fs::path tmp;
+    fs::path path;
+};
+
+struct BlockExport
+{
+    std::string name;
+    fs::path source;
+    fs::path out;
+    k4a_playback_t playback = nullptr;
+
+    std::mutex mutex;
+    size_t in_flight = 0;
+    bool reader_parked = false;
+    bool reading_done = false;
+    bool imu_done = false;
+    bool completed = false;
+    bool failed = false;
+    // frames are numbered by the reader and committed (renamed into place) in that order
+    uint64_t next_sequence = 0;
+    uint64_t next_commit = 0;
+    std::map<uint64_t, std::vector<output_file_t>> finished;
+    size_t frames_exported = 0;
+    size_t frames_present = 0;
+};
+
+bool write_file(const fs::path &path, const uint8_t *data, size_t size)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(size));
+    return out.good();
+}
+
+// 16 bit grayscale PNG, libpng errors are turned into a false return
+bool write_png16(const fs::path &path, k4a_image_t image)
+{
+    FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png != nullptr ? png_create_info_struct(png) : nullptr;
+    if (info == nullptr || setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_write_struct(&png, &info);
+        std::fclose(file);
+        return false;
+    }
+    int width = k4a_image_get_width_pixels(image);
+    int height = k4a_image_get_height_pixels(image);
+    int stride = k4a_image_get_stride_bytes(image);
+    uint8_t *data = k4a_image_get_buffer(image);
+    png_init_io(png, file);
+    png_set_compression_level(png, png_compression_level);
+    png_set_filter(png, 0, PNG_FILTER_SUB);
+    png_set_IHDR(png, info, static_cast<png_uint_32>(width), static_cast<png_uint_32>(height), 16,
+                 PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    // PNG samples are big endian, k4a images are little endian
+    png_set_swap(png);
+    for (int y = 0; y < height; ++y)
+    {
+        png_write_row(png, data + static_cast<size_t>(y) * stride);
+    }
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return std::fclose(file) == 0;
+}
+
+bool encode_color(k4a_image_t image, int quality, std::vector<uint8_t> &jpeg)
+{
+    if (k4a_image_get_format(image) == K4A_IMAGE_FORMAT_COLOR_MJPG)
+    {
+        uint8_t *data = k4a_image_get_buffer(image);
+        jpeg.assign(data, data + k4a_image_get_size(image));
+        return true;
+    }
+    std::vector<uint8_t> rgb;
+    int width, height;
+    switch (k4a_image_get_format(image))
+    {
+    case K4A_IMAGE_FORMAT_COLOR_NV12:
+    case K4A_IMAGE_FORMAT_COLOR_YUY2:
+    case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+        scale_color(image, 1, rgb, width, height);
+        return encode_jpeg(rgb, width, height, quality, jpeg);
+    default:
+        return false;
+    }
+}
+
+std::string frame_file_name(k4a_image_t image, const char *extension)
+{
+    // zero padded so the files sort by time
+    return fmt::format("{:012}{}", k4a_image_get_device_timestamp_usec(image), extension);
+}
+
+class SessionExport
+{
+public:
+    SessionExport(const fs::path &output_dir, const export_options_t &options) :
+        m_output_dir(output_dir),
+        m_options(options),
+        m_pool(options.threads),
+        m_active_limit(std::max(1u, options.threads / 2))
+    {
+    }
+
+    int run(std::vector<std::shared_ptr<BlockExport>> blocks)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pending.assign(blocks.begin(), blocks.end());
+            for (size_t i = 0; i < m_active_limit; ++i)
+            {
+                start_next_block();
+            }
+        }
+        m_pool.wait_idle();
+        return m_failed;
+    }
+
+private:
+    // with m_mutex held
+    void start_next_block()
+    {
+        if (m_pending.empty())
+        {
+            return;
+        }
+        std::shared_ptr<BlockExport> block = m_pending.front();
+        m_pending.pop_front();
+        m_pool.submit([this, block]() { start_block(block); });
+    }
+
+    void start_block(const std::shared_ptr<BlockExport> &block)
+    {
+        std::error_code error;
+        for (const char *dir : {"color", "depth", "ir"})
+        {
+            fs::create_directories(block->out / dir, error);
+            // temp files of an interrupted export
+            for (const auto &entry : fs::directory_iterator(block->out / dir, error))
+            {
+                if (entry.path().extension() == ".tmp")
+                {
+                    fs::remove(entry.path(), error);
+                }
+            }
+        }
+        if (K4A_FAILED(k4a_playback_open(block->source.c_str(), &block->playback)))
+        {
+            std::cerr << "Unable to open block: " << block->source.string() << std::endl;
+            block->playback = nullptr;
+            std::lock_guard<std::mutex> lock(block->mutex);
+            block->failed = true;
+            block->reading_done = true;
+            block->imu_done = true;
+            finish_if_done(*block);
+            return;
+        }
+
+        size_t calibration_size = 0;
+        if (k4a_playback_get_raw_calibration(block->playback, nullptr, &calibration_size) ==
+            K4A_BUFFER_RESULT_TOO_SMALL)
+        {
+            std::vector<uint8_t> calibration(calibration_size);
+            if (k4a_playback_get_raw_calibration(block->playback, calibration.data(), &calibration_size) ==
+                    K4A_BUFFER_RESULT_SUCCEEDED &&
+                !write_file(block->out / "calibration.json", calibration.data(), calibration_size))
+            {
+                std::cerr << "Unable to write calibration of: " << block->name << std::endl;
+            }
+        }
+
+        k4a_record_configuration_t config;
+        bool has_imu = K4A_SUCCEEDED(k4a_playback_get_record_configuration(block->playback, &config)) &&
+                       config.imu_track_enabled;
+        if (m_options.imu && has_imu && !fs::exists(block->out / "imu.csv"))
+        {
+            m_pool.submit([this, block]() { export_imu(block); });
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(block->mutex);
+            block->imu_done = true;
+        }
+        read_frames(block);
+    }
+
+    // Read captures until the block has frames_in_flight_per_block frames queued, the last encode
+    // task of a full block resumes reading.
+    void read_frames(const std::shared_ptr<BlockExport> &block)
+    {
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(block->mutex);
+                if (block->in_flight >= frames_in_flight_per_block)
+                {
+                    block->reader_parked = true;
+                    return;
+                }
+            }
+
+            k4a_capture_t capture = nullptr;
+            k4a_stream_result_t result = k4a_playback_get_next_capture(block->playback, &capture);
+            if (result != K4A_STREAM_RESULT_SUCCEEDED)
+            {
+                std::lock_guard<std::mutex> lock(block->mutex);
+                if (result == K4A_STREAM_RESULT_FAILED)
+                {
+                    std::cerr << "Unable to read a capture from: " << block->name << std::endl;
+                    block->failed = true;
+                }
+                block->reading_done = true;
+                finish_if_done(*block);
+                return;
+            }
+
+            if (frame_present(*block, capture))
+            {
+                k4a_capture_release(capture);
+                std::lock_guard<std::mutex> lock(block->mutex);
+                ++block->frames_present;
+                continue;
+            }
+            uint64_t sequence;
+            {
+                std::lock_guard<std::mutex> lock(block->mutex);
+                sequence = block->next_sequence++;
+                ++block->in_flight;
+            }
+            m_pool.submit([this, block, capture, sequence]() { export_frame(block, capture, sequence); });
+        }
+    }
+
+    // all outputs of this capture exist from an earlier run
+    bool frame_present(const BlockExport &block, k4a_capture_t capture)
+    {
+        bool present = true;
+        std::pair<k4a_image_t, fs::path> images[] = {
+            {m_options.color ? k4a_capture_get_color_image(capture) : nullptr, block.out / "color"},
+            {m_options.depth ? k4a_capture_get_depth_image(capture) : nullptr, block.out / "depth"},
+            {m_options.ir ? k4a_capture_get_ir_image(capture) : nullptr, block.out / "ir"}};
+        for (size_t i = 0; i < 3; ++i)
+        {
+            if (images[i].first != nullptr)
+            {
+                present = present && fs::exists(images[i].second /
+                                                frame_file_name(images[i].first, i == 0 ? ".jpg" : ".png"));
+                k4a_image_release(images[i].first);
+            }
+        }
+        return present;
+    }
+
+    void export_frame(const std::shared_ptr<BlockExport> &block, k4a_capture_t capture, uint64_t sequence)
+    {
+        std::vector<output_file_t> files;
+        bool ok = true;
+        k4a_image_t color = m_options.color ? k4a_capture_get_color_image(capture) : nullptr;
+        if (color != nullptr)
+        {
+            output_file_t file;
+            file.path = block->out / "color" / frame_file_name(color, ".jpg");
+            file.tmp = file.path.string() + ".tmp";
+            std::vector<uint8_t> jpeg;
+            ok = encode_color(color, m_options.jpeg_quality, jpeg) && write_file(file.tmp, jpeg.data(), jpeg.size());
+            files.push_back(file);
+            k4a_image_release(color);
+        }
+        std::pair<k4a_image_t, const char *> images[] = {
+            {m_options.depth ? k4a_capture_get_depth_image(capture) : nullptr, "depth"},
+            {m_options.ir ? k4a_capture_get_ir_image(capture) : nullptr, "ir"}};
+        for (const auto &image : images)
+        {
+            if (image.first != nullptr)
+            {
+                output_file_t file;
+                file.path = block->out / image.second / frame_file_name(image.first, ".png");
+                file.tmp = file.path.string() + ".tmp";
+                ok = ok && write_png16(file.tmp, image.first);
+                files.push_back(file);
+                k4a_image_release(image.first);
+            }
+        }
+        k4a_capture_release(capture);
+
+        bool resume_reading = false;
+        {
+            std::lock_guard<std::mutex> lock(block->mutex);
+            if (!ok && !block->failed)
+            {
+                std::cerr << "Unable to export a frame of: " << block->name << std::endl;
+                block->failed = true;
+            }
+            block->finished[sequence] = ok ? std::move(files) : std::vector<output_file_t>();
+            commit_frames(*block);
+            --block->in_flight;
+            if (block->reader_parked && block->in_flight <= frames_in_flight_per_block / 2)
+            {
+                block->reader_parked = false;
+                resume_reading = true;
+            }
+            finish_if_done(*block);
+        }
+        if (resume_reading)
+        {
+            m_pool.submit([this, block]() { read_frames(block); });
+        }
+    }
+
+    // move finished frames into place in reading order, with block->mutex held
+    void commit_frames(BlockExport &block)
+    {
+        std::error_code error;
+        for (auto it = block.finished.begin(); it != block.finished.end() && it->first == block.next_commit;
+             it = block.finished.erase(it))
+        {
+            for (const output_file_t &file : it->second)
+            {
+                fs::rename(file.tmp, file.path, error);
+                if (error && !block.failed)
+                {
+                    std::cerr << "Unable to rename " << file.tmp.string() << ": " << error.message() << std::endl;
+                    block.failed = true;
+                }
+            }
+            ++block.frames_exported;
+            ++block.next_commit;
+        }
+    }
+
+    void export_imu(const std::shared_ptr<BlockExport> &block)
+    {
+        // IMU samples have their own cursor, a second handle keeps them independent of the capture reader
+        k4a_playback_t playback = nullptr;
+        bool ok = K4A_SUCCEEDED(k4a_playback_open(block->source.c_str(), &playback));
+        fs::path path = block->out / "imu.csv";
+        fs::path tmp = path.string() + ".tmp";
+        if (ok)
+        {
+            std::ofstream csv(tmp, std::ios::trunc);
+            csv << "acc_timestamp_usec,acc_x,acc_y,acc_z,gyro_timestamp_usec,gyro_x,gyro_y,gyro_z,temperature\n";
+            k4a_imu_sample_t sample;
+            k4a_stream_result_t result;
+            while ((result = k4a_playback_get_next_imu_sample(playback, &sample)) == K4A_STREAM_RESULT_SUCCEEDED)
+            {
+                csv << fmt::format("{},{},{},{},{},{},{},{},{}\n", sample.acc_timestamp_usec, sample.acc_sample.xyz.x,
+                                   sample.acc_sample.xyz.y, sample.acc_sample.xyz.z, sample.gyro_timestamp_usec,
+                                   sample.gyro_sample.xyz.x, sample.gyro_sample.xyz.y, sample.gyro_sample.xyz.z,
+                                   sample.temperature);
+            }
+            csv.close();
+            k4a_playback_close(playback);
+            std::error_code error;
+            ok = result == K4A_STREAM_RESULT_EOF && csv.good();
+            if (ok)
+            {
+                fs::rename(tmp, path, error);
+                ok = !error;
+            }
+        }
+        std::lock_guard<std::mutex> lock(block->mutex);
+        if (!ok)
+        {
+            std::cerr << "Unable to export the IMU samples of: " << block->name << std::endl;
+            block->failed = true;
+        }
+        block->imu_done = true;
+        finish_if_done(*block);
+    }
+
+    // with block.mutex held
+    void finish_if_done(BlockExport &block)
+    {
+        if (block.completed || !block.reading_done || !block.imu_done || block.in_flight > 0)
+        {
+            return;
+        }
+        block.completed = true;
+        if (block.playback != nullptr)
+        {
+            k4a_playback_close(block.playback);
+            block.playback = nullptr;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (block.failed)
+        {
+            ++m_failed;
+            std::cout << block.name << ": FAILED" << std::endl;
+        }
+        else
+        {
+            std::ofstream done(m_output_dir / export_done_name, std::ios::app);
+            done << block.name << std::endl;
+            std::cout << block.name << ": " << block.frames_exported << " frames exported";
+            if (block.frames_present > 0)
+            {
+                std::cout << ", " << block.frames_present << " already present";
+            }
+            std::cout << std::endl;
+        }
+        start_next_block();
+    }
+
+    fs::path m_output_dir;
+    export_options_t m_options;
+    TaskPool m_pool;
+    size_t m_active_limit;
+
+    std::mutex m_mutex;
+    std::deque<std::shared_ptr<BlockExport>> m_pending;
+    int m_failed = 0;
+};
+} // namespace
+
+int export_session(const std::string &session_dir, const std::string &output_dir, const export_options_t &options)
+{
+    std::error_code error;
+    if (!fs::is_directory(session_dir, error))
+    {
+        std::cerr << "Not a recording directory: " << session_dir << std::endl;
+        return 1;
+    }
+    fs::create_directories(output_dir, error);
+    if (error)
+    {
+        std::cerr << "Unable to create " << output_dir << ": " << error.message() << std::endl;
+        return 1;
+    }
+
+    std::set<std::string> done;
+    std::ifstream done_list(fs::path(output_dir) / export_done_name);
+    std::string line;
+    while (std::getline(done_list, line))
+    {
+        done.insert(line);
+    }
+
+    std::vector<fs::path> sources;
+    for (const auto &entry : fs::directory_iterator(session_dir))
+    {
+        std::string name = entry.path().filename().string();
+        // finalized blocks only, no temp files of a running recording and no proxies
+        if (entry.is_regular_file() && entry.path().extension() == ".mkv" &&
+            name.find(".proxy.") == std::string::npos && name.rfind("_temp_", 0) != 0)
+        {
+            sources.push_back(entry.path());
+        }
+    }
+    std::sort(sources.begin(), sources.end());
+
+    std::vector<std::shared_ptr<BlockExport>> blocks;
+    for (const fs::path &source : sources)
+    {
+        std::string name = source.filename().string();
+        if (done.count(name) > 0)
+        {
+            continue;
+        }
+        auto block = std::make_shared<BlockExport>();
+        block->name = name;
+        block->source = source;
+        block->out = fs::path(output_dir) / source.stem();
+        blocks.push_back(block);
+    }
+    std::cout << "Exporting " << blocks.size() << " of " << sources.size() << " blocks on " << options.threads
+              << " threads." << std::endl;
+
+    SessionExport session(output_dir, options);
+    int failed = session.run(blocks);
+    std::cout << "Exported " << blocks.size() - failed << " blocks, " << failed << " failed." << std::endl;
+    return failed;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+// Name of the list of completely exported blocks in the output directory, used to resume an export.
+static const char *const export_done_name = "export.done";
+
+struct export_options_t
+{
+    unsigned threads = 1;
+    int jpeg_quality = 90;
+    bool color = true;
+    bool depth = true;
+    bool ir = true;
+    bool imu = true;
+};
+
+// Export every block of a recording directory into output_dir/<block>/:
+//   color/<device usec>.jpg   MJPG frames as recorded, other formats encoded with jpeg_quality
+//   depth/<device usec>.png   16 bit grayscale, millimeters
+//   ir/<device usec>.png      16 bit grayscale
+//   imu.csv, calibration.json
+// Blocks are read and encoded concurrently on a TaskPool, frame files of a block appear in timestamp
+// order. Blocks listed in export.done are skipped and frames already on disk are not encoded again, so
+// an interrupted export continues where it stopped. Returns the number of blocks that failed.
+int export_session(const std::string &session_dir, const std::string &output_dir, const export_options_t &options);
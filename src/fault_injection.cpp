@@ -0,0 +1,130 @@
+#include "fault_injection.h"
+#include "option_spec.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <thread>
+
+using namespace std::chrono;
+
+namespace
+{
+struct FaultConfig
+{
+    bool enabled = false;
+    uint32_t write_latency_ms = 0;
+    double write_latency_rate = 0.0;
+    double bandwidth_bytes = 0.0;
+    uint32_t flush_delay_ms = 0;
+    double enospc_after_bytes = 0.0;
+    double rename_fail_rate = 0.0;
+};
+
+FaultConfig config;
+std::mutex fault_mutex;
+std::mt19937 rng(1);
+double bytes_written = 0.0;
+steady_clock::time_point throttle_start;
+
+bool roll(double probability)
+{
+    std::lock_guard<std::mutex> lock(fault_mutex);
+    return probability > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(rng) < probability;
+}
+} // namespace
+
+void fault_injection_configure(const std::string &spec)
+{
+    auto values = parse_option_spec(spec);
+    double value;
+    if (take_option(values, "write_latency_ms", value))
+        config.write_latency_ms = static_cast<uint32_t>(value);
+    if (take_option(values, "write_latency_rate", value))
+        config.write_latency_rate = value;
+    if (take_option(values, "bandwidth_mb", value))
+        config.bandwidth_bytes = value * 1024 * 1024;
+    if (take_option(values, "flush_delay_ms", value))
+        config.flush_delay_ms = static_cast<uint32_t>(value);
+    if (take_option(values, "enospc_after_mb", value))
+        config.enospc_after_bytes = value * 1024 * 1024;
+    if (take_option(values, "rename_fail_rate", value))
+        config.rename_fail_rate = value;
+    if (take_option(values, "seed", value))
+        rng.seed(static_cast<uint32_t>(value));
+    check_no_options_left(values, "fault injection");
+
+    config.enabled = true;
+    throttle_start = steady_clock::now();
+}
+
+bool fault_injection_enabled()
+{
+    return config.enabled;
+}
+
+uint32_t fault_max_write_stall_ms()
+{
+    if (!config.enabled)
+    {
+        return 0;
+    }
+    if (config.bandwidth_bytes > 0.0)
+    {
+        return UINT32_MAX;
+    }
+    return config.write_latency_rate > 0.0 ? config.write_latency_ms : 0;
+}
+
+uint32_t fault_flush_delay_ms()
+{
+    return config.enabled ? config.flush_delay_ms : 0;
+}
+
+bool fault_before_write(size_t bytes)
+{
+    if (!config.enabled)
+    {
+        return true;
+    }
+
+    steady_clock::time_point wake;
+    {
+        std::lock_guard<std::mutex> lock(fault_mutex);
+        if (config.enospc_after_bytes > 0.0 && bytes_written + bytes > config.enospc_after_bytes)
+        {
+            errno = ENOSPC;
+            return false;
+        }
+        bytes_written += bytes;
+        wake = config.bandwidth_bytes > 0.0
+                   ? throttle_start + microseconds(static_cast<int64_t>(bytes_written / config.bandwidth_bytes * 1e6))
+                   : steady_clock::now();
+    }
+    if (roll(config.write_latency_rate))
+    {
+        std::this_thread::sleep_for(milliseconds(config.write_latency_ms));
+    }
+    std::this_thread::sleep_until(wake);
+    return true;
+}
+
+void fault_before_flush()
+{
+    if (config.enabled && config.flush_delay_ms > 0)
+    {
+        std::this_thread::sleep_for(milliseconds(config.flush_delay_ms));
+    }
+}
+
+int fault_rename(const char *from, const char *to)
+{
+    if (config.enabled && roll(config.rename_fail_rate))
+    {
+        errno = EIO;
+        return -1;
+    }
+    return std::rename(from, to);
+}
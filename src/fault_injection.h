@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Fault injection for reproducing field failures without hardware or a bad disk. Only built with
+// ATLAS_FAULT_INJECTION (cmake -DATLAS_FAULT_INJECTION=ON and the simulation test), release builds get
+// the no-op hooks below. Configured with a comma separated key=value list (--inject-faults):
+//   write_latency_ms=N    stall a capture write for N ms ...
+//   write_latency_rate=P  ... with probability P (default: 0)
+//   bandwidth_mb=N        throttle capture writes to N MB/s (default: unlimited)
+//   flush_delay_ms=N      delay every block flush by N ms (default: 0)
+//   enospc_after_mb=N     fail capture writes as if the disk were full after N MB (default: never)
+//   rename_fail_rate=P    fail block renames with probability P (default: 0)
+//   seed=N                random seed (default: 1)
+#if defined(ATLAS_FAULT_INJECTION)
+
+// throws std::runtime_error on an invalid spec
+void fault_injection_configure(const std::string &spec);
+
+bool fault_injection_enabled();
+
+// Longest time a single capture write may be held up by the injected faults, UINT32_MAX if writes are
+// bandwidth limited and can fall behind without bound.
+uint32_t fault_max_write_stall_ms();
+
+uint32_t fault_flush_delay_ms();
+
+// Call before writing a capture of size bytes. Sleeps for injected latency and returns false
+// when the write should fail with ENOSPC.
+bool fault_before_write(size_t bytes);
+
+void fault_before_flush();
+
+// std::rename that may fail with EIO.
+int fault_rename(const char *from, const char *to);
+
+#else
+
+inline bool fault_injection_enabled()
+{
+    return false;
+}
+
+inline uint32_t fault_max_write_stall_ms()
+{
+    return 0;
+}
+
+inline uint32_t fault_flush_delay_ms()
+{
+    return 0;
+}
+
+inline bool fault_before_write(size_t)
+{
+    return true;
+}
+
+inline void fault_before_flush()
+{
+}
+
+inline int fault_rename(const char *from, const char *to)
+{
+    return std::rename(from, to);
+}
+
+#endif
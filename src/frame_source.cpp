@@ -0,0 +1,294 @@
+#include "frame_source.h"
+#include "option_spec.h"
+#include "recorder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+using namespace std::chrono;
+
+static const uint64_t imu_rate_hz = 1600;
+static const uint64_t device_timestamp_origin_usec = 1000000;
+
+SyntheticFrameSource::SyntheticFrameSource(const std::string &spec, const k4a_device_configuration_t &config, bool imu) :
+    m_config(config),
+    m_imu(imu)
+{
+    auto values = parse_option_spec(spec);
+    double value;
+    if (take_option(values, "frames", value))
+        m_frames = static_cast<uint64_t>(value);
+    if (take_option(values, "jitter_ms", value))
+        m_jitter_ms = static_cast<uint32_t>(value);
+    if (take_option(values, "stall_every", value))
+        m_stall_every = static_cast<uint32_t>(value);
+    if (take_option(values, "stall_ms", value))
+        m_stall_ms = static_cast<uint32_t>(value);
+    if (take_option(values, "buffer", value))
+        m_buffer = std::max<size_t>(1, static_cast<size_t>(value));
+    if (take_option(values, "seed", value))
+        m_seed = static_cast<uint32_t>(value);
+    if (take_option(values, "max_shutdown_ms", value))
+        m_max_shutdown_ms = static_cast<int64_t>(value);
+    if (take_option(values, "pool", value))
+        m_pool_size = std::max<size_t>(1, static_cast<size_t>(value));
+    check_no_options_left(values, "simulation");
+
+    uint32_t fps = k4a_convert_fps_to_uint(config.camera_fps);
+    m_period_usec = 1000000 / (fps > 0 ? fps : 30);
+    m_rng.seed(m_seed);
+    m_start = steady_clock::now();
+    m_next_arrival = arrival_time(0);
+
+    int width, height;
+    k4a_color_resolution_to_size(config.color_resolution, width, height);
+    if (width > 0)
+    {
+        int stride;
+        size_t size;
+        switch (config.color_format)
+        {
+        case K4A_IMAGE_FORMAT_COLOR_NV12:
+            stride = width;
+            size = static_cast<size_t>(width) * height * 3 / 2;
+            break;
+        case K4A_IMAGE_FORMAT_COLOR_YUY2:
+            stride = width * 2;
+            size = static_cast<size_t>(stride) * height;
+            break;
+        case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+            stride = width * 4;
+            size = static_cast<size_t>(stride) * height;
+            break;
+        default:
+            // compressed frames have no stride, assume roughly 1:8 compression
+            stride = 0;
+            size = static_cast<size_t>(width) * height / 8;
+            break;
+        }
+        m_color_pool = std::make_unique<ImagePool>(config.color_format, width, height, stride, size, m_pool_size);
+    }
+    k4a_depth_mode_to_size(config.depth_mode, width, height);
+    if (width > 0)
+    {
+        size_t size = static_cast<size_t>(width) * height * 2;
+        if (config.depth_mode != K4A_DEPTH_MODE_PASSIVE_IR)
+        {
+            m_depth_pool = std::make_unique<ImagePool>(K4A_IMAGE_FORMAT_DEPTH16, width, height, width * 2, size,
+                                                       m_pool_size);
+        }
+        m_ir_pool = std::make_unique<ImagePool>(K4A_IMAGE_FORMAT_IR16, width, height, width * 2, size, m_pool_size);
+    }
+}
+
+steady_clock::time_point SyntheticFrameSource::arrival_time(uint64_t frame) const
+{
+    auto nominal = m_start + microseconds(frame * m_period_usec);
+    if (m_stall_every > 0 && m_stall_ms > 0 && frame > 0)
+    {
+        // frames that fall into a stall window arrive together once it ends
+        uint64_t stall_frame = frame - frame % m_stall_every;
+        if (stall_frame > 0)
+        {
+            auto stall_end = m_start + microseconds(stall_frame * m_period_usec) + milliseconds(m_stall_ms);
+            nominal = std::max(nominal, stall_end);
+        }
+    }
+    return nominal;
+}
+
+void SyntheticFrameSource::produce_due_frames()
+{
+    auto now = steady_clock::now();
+    while (m_produced < m_frames && now >= m_next_arrival)
+    {
+        m_queue.push_back(m_produced);
+        if (m_queue.size() > m_buffer)
+        {
+            // the SDK drops the oldest capture when the application does not keep up
+            m_queue.pop_front();
+            ++m_dropped;
+        }
+        ++m_produced;
+
+        auto next = arrival_time(m_produced);
+        if (m_jitter_ms > 0)
+        {
+            next += microseconds(std::uniform_int_distribution<uint32_t>(0, m_jitter_ms * 1000)(m_rng));
+        }
+        m_next_arrival = std::max(next, m_next_arrival);
+    }
+}
+
+k4a_wait_result_t SyntheticFrameSource::get_capture(k4a_capture_t *capture, int32_t timeout_ms)
+{
+    produce_due_frames();
+    if (m_queue.empty())
+    {
+        if (finished())
+        {
+            return K4A_WAIT_RESULT_FAILED;
+        }
+        auto wake = m_next_arrival;
+        if (timeout_ms >= 0)
+        {
+            wake = std::min(wake, steady_clock::now() + milliseconds(timeout_ms));
+        }
+        std::this_thread::sleep_until(wake);
+        produce_due_frames();
+        if (m_queue.empty())
+        {
+            return K4A_WAIT_RESULT_TIMEOUT;
+        }
+    }
+
+    uint64_t frame = m_queue.front();
+    m_queue.pop_front();
+    *capture = make_capture(frame);
+    if (*capture == nullptr)
+    {
+        return K4A_WAIT_RESULT_FAILED;
+    }
+    ++m_delivered;
+    return K4A_WAIT_RESULT_SUCCEEDED;
+}
+
+k4a_wait_result_t SyntheticFrameSource::get_imu_sample(k4a_imu_sample_t *sample, int32_t timeout_ms)
+{
+    (void)timeout_ms;
+    if (!m_imu)
+    {
+        return K4A_WAIT_RESULT_FAILED;
+    }
+    // IMU samples are only handed out up to the device time of the newest produced frame
+    uint64_t produced_usec = m_produced * m_period_usec;
+    if (m_imu_samples * 1000000 / imu_rate_hz >= produced_usec)
+    {
+        return K4A_WAIT_RESULT_TIMEOUT;
+    }
+
+    uint64_t timestamp = device_timestamp_origin_usec + m_imu_samples * 1000000 / imu_rate_hz;
+    std::normal_distribution<float> noise(0.0f, 0.05f);
+    sample->temperature = 30.0f;
+    sample->acc_sample.xyz.x = noise(m_rng);
+    sample->acc_sample.xyz.y = noise(m_rng);
+    sample->acc_sample.xyz.z = -9.81f + noise(m_rng);
+    sample->acc_timestamp_usec = timestamp;
+    sample->gyro_sample.xyz.x = noise(m_rng);
+    sample->gyro_sample.xyz.y = noise(m_rng);
+    sample->gyro_sample.xyz.z = noise(m_rng);
+    sample->gyro_timestamp_usec = timestamp;
+    ++m_imu_samples;
+    return K4A_WAIT_RESULT_SUCCEEDED;
+}
+
+k4a_result_t SyntheticFrameSource::get_calibration(const k4a_device_configuration_t &config,
+                                                   k4a_calibration_t *calibration)
+{
+    std::memset(calibration, 0, sizeof(*calibration));
+    calibration->depth_mode = config.depth_mode;
+    calibration->color_resolution = config.color_resolution;
+
+    auto set_camera = [](k4a_calibration_camera_t &camera, int width, int height, float focal_ratio) {
+        camera.resolution_width = width;
+        camera.resolution_height = height;
+        camera.metric_radius = 1.7f;
+        camera.intrinsics.type = K4A_CALIBRATION_LENS_DISTORTION_MODEL_BROWN_CONRADY;
+        camera.intrinsics.parameter_count = 14;
+        camera.intrinsics.parameters.param.cx = width / 2.0f;
+        camera.intrinsics.parameters.param.cy = height / 2.0f;
+        camera.intrinsics.parameters.param.fx = width * focal_ratio;
+        camera.intrinsics.parameters.param.fy = width * focal_ratio;
+        camera.intrinsics.parameters.param.metric_radius = 1.7f;
+        camera.extrinsics.rotation[0] = camera.extrinsics.rotation[4] = camera.extrinsics.rotation[8] = 1.0f;
+    };
+    int width, height;
+    k4a_depth_mode_to_size(config.depth_mode, width, height);
+    set_camera(calibration->depth_camera_calibration, width, height, 0.79f);
+    k4a_color_resolution_to_size(config.color_resolution, width, height);
+    set_camera(calibration->color_camera_calibration, width, height, 0.48f);
+
+    for (int from = 0; from < K4A_CALIBRATION_TYPE_NUM; ++from)
+    {
+        for (int to = 0; to < K4A_CALIBRATION_TYPE_NUM; ++to)
+        {
+            k4a_calibration_extrinsics_t &extrinsics = calibration->extrinsics[from][to];
+            extrinsics.rotation[0] = extrinsics.rotation[4] = extrinsics.rotation[8] = 1.0f;
+        }
+    }
+    // the color camera sits about 32mm to the side of the depth camera
+    calibration->extrinsics[K4A_CALIBRATION_TYPE_DEPTH][K4A_CALIBRATION_TYPE_COLOR].translation[0] = -32.0f;
+    calibration->extrinsics[K4A_CALIBRATION_TYPE_COLOR][K4A_CALIBRATION_TYPE_DEPTH].translation[0] = 32.0f;
+    return K4A_RESULT_SUCCEEDED;
+}
+
+bool SyntheticFrameSource::finished() const
+{
+    return m_produced >= m_frames && m_queue.empty();
+}
+
+k4a_capture_t SyntheticFrameSource::make_capture(uint64_t frame)
+{
+    k4a_capture_t capture = nullptr;
+    if (K4A_FAILED(k4a_capture_create(&capture)))
+    {
+        return nullptr;
+    }
+
+    uint64_t timestamp = device_timestamp_origin_usec + frame * m_period_usec;
+    uint64_t system_timestamp =
+        static_cast<uint64_t>(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+
+    int width, height;
+    if (m_color_pool)
+    {
+        k4a_image_t image = m_color_pool->create_image();
+        if (image != nullptr)
+        {
+            std::memset(k4a_image_get_buffer(image), static_cast<int>(frame & 0xff), k4a_image_get_size(image));
+            k4a_image_set_device_timestamp_usec(image, timestamp);
+            k4a_image_set_system_timestamp_nsec(image, system_timestamp);
+            k4a_image_set_exposure_usec(image, 10000);
+            k4a_capture_set_color_image(capture, image);
+            k4a_image_release(image);
+        }
+    }
+
+    k4a_depth_mode_to_size(m_config.depth_mode, width, height);
+    if (width > 0)
+    {
+        uint64_t depth_timestamp = timestamp + m_config.depth_delay_off_color_usec;
+        k4a_image_t depth = m_depth_pool ? m_depth_pool->create_image() : nullptr;
+        if (depth != nullptr)
+        {
+            // a slowly moving ramp with an invalid border, enough structure for downstream statistics
+            uint16_t *pixels = reinterpret_cast<uint16_t *>(k4a_image_get_buffer(depth));
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    bool border = x < 8 || y < 8 || x >= width - 8 || y >= height - 8;
+                    pixels[y * width + x] = border ? 0 : static_cast<uint16_t>(500 + (x + y + frame * 4) % 3000);
+                }
+            }
+            k4a_image_set_device_timestamp_usec(depth, depth_timestamp);
+            k4a_image_set_system_timestamp_nsec(depth, system_timestamp);
+            k4a_capture_set_depth_image(capture, depth);
+            k4a_image_release(depth);
+        }
+
+        k4a_image_t ir = m_ir_pool->create_image();
+        if (ir != nullptr)
+        {
+            uint16_t *pixels = reinterpret_cast<uint16_t *>(k4a_image_get_buffer(ir));
+            std::fill(pixels, pixels + static_cast<size_t>(width) * height, static_cast<uint16_t>(100 + frame % 100));
+            k4a_image_set_device_timestamp_usec(ir, depth_timestamp);
+            k4a_image_set_system_timestamp_nsec(ir, system_timestamp);
+            k4a_capture_set_ir_image(capture, ir);
+            k4a_image_release(ir);
+        }
+    }
+
+    return capture;
+}
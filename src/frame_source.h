@@ -0,0 +1,147 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <k4a/k4a.h>
+
+#include "image_pool.h"
+
+// Where the recorder pulls captures and IMU samples from.
+class FrameSource
+{
+public:
+    virtual ~FrameSource() = default;
+
+    virtual k4a_wait_result_t get_capture(k4a_capture_t *capture, int32_t timeout_ms) = 0;
+    virtual k4a_wait_result_t get_imu_sample(k4a_imu_sample_t *sample, int32_t timeout_ms) = 0;
+    virtual k4a_result_t get_calibration(const k4a_device_configuration_t &config, k4a_calibration_t *calibration) = 0;
+
+    // true once a finite source has delivered everything, K4A_WAIT_RESULT_FAILED is returned afterwards
+    virtual bool finished() const
+    {
+        return false;
+    }
+};
+
+class DeviceFrameSource : public FrameSource
+{
+public:
+    // raw_calibration is the device's calibration blob (see device_probe.h), empty to ask the device
+    DeviceFrameSource(k4a_device_t device, std::vector<uint8_t> raw_calibration) :
+        m_device(device),
+        m_raw_calibration(std::move(raw_calibration))
+    {
+    }
+
+    k4a_wait_result_t get_capture(k4a_capture_t *capture, int32_t timeout_ms) override
+    {
+        return k4a_device_get_capture(m_device, capture, timeout_ms);
+    }
+
+    k4a_wait_result_t get_imu_sample(k4a_imu_sample_t *sample, int32_t timeout_ms) override
+    {
+        return k4a_device_get_imu_sample(m_device, sample, timeout_ms);
+    }
+
+    k4a_result_t get_calibration(const k4a_device_configuration_t &config, k4a_calibration_t *calibration) override
+    {
+        if (m_raw_calibration.empty())
+        {
+            return k4a_device_get_calibration(m_device, config.depth_mode, config.color_resolution, calibration);
+        }
+        std::vector<char> raw(m_raw_calibration.begin(), m_raw_calibration.end());
+        raw.push_back('\0');
+        return k4a_calibration_get_from_raw(raw.data(), raw.size(), config.depth_mode, config.color_resolution,
+                                            calibration);
+    }
+
+private:
+    k4a_device_t m_device;
+    std::vector<uint8_t> m_raw_calibration;
+};
+
+// Scripted, deterministic stand-in for a device, configured with a comma separated key=value list:
+//   frames=N          captures to produce before finishing (default: 900)
+//   jitter_ms=N       random extra arrival delay per frame (default: 0)
+//   stall_every=N     every Nth frame the source stalls ...
+//   stall_ms=N        ... for this long (default: 0)
+//   buffer=N          captures the "device" queues before dropping the oldest (default: 2, like the SDK)
+//   seed=N            random seed (default: 1)
+//   max_shutdown_ms=N longest acceptable time from the stop signal (or the last frame) to all blocks
+//                     finalized (default: 5000)
+//   pool=N            preallocated image buffers per stream (default: 48)
+// Frames are produced in real time at the configured camera fps with the image sizes of the device config,
+// their buffers come from an ImagePool per stream.
+class SyntheticFrameSource : public FrameSource
+{
+public:
+    SyntheticFrameSource(const std::string &spec, const k4a_device_configuration_t &config, bool imu);
+
+    k4a_wait_result_t get_capture(k4a_capture_t *capture, int32_t timeout_ms) override;
+    k4a_wait_result_t get_imu_sample(k4a_imu_sample_t *sample, int32_t timeout_ms) override;
+    // ideal pinhole cameras with a typical color/depth baseline
+    k4a_result_t get_calibration(const k4a_device_configuration_t &config, k4a_calibration_t *calibration) override;
+    bool finished() const override;
+
+    uint64_t frames_produced() const
+    {
+        return m_produced;
+    }
+    uint64_t frames_dropped() const
+    {
+        return m_dropped;
+    }
+    uint64_t frames_delivered() const
+    {
+        return m_delivered;
+    }
+    int64_t max_shutdown_ms() const
+    {
+        return m_max_shutdown_ms;
+    }
+    // True if the longest burst of frames, from stalls and jitter plus write_stall_ms of the recorder
+    // being held up, fits into the device buffer, i.e. a recorder that keeps up drops nothing.
+    bool within_buffer_budget(uint32_t write_stall_ms) const
+    {
+        uint64_t stall_ms = m_stall_every > 0 ? m_stall_ms : 0;
+        uint64_t stall_usec = (stall_ms + m_jitter_ms + write_stall_ms) * 1000;
+        return stall_usec < m_buffer * m_period_usec;
+    }
+
+private:
+    std::chrono::steady_clock::time_point arrival_time(uint64_t frame) const;
+    void produce_due_frames();
+    k4a_capture_t make_capture(uint64_t frame);
+
+    k4a_device_configuration_t m_config;
+    bool m_imu;
+    uint64_t m_frames = 900;
+    uint32_t m_jitter_ms = 0;
+    uint32_t m_stall_every = 0;
+    uint32_t m_stall_ms = 0;
+    size_t m_buffer = 2;
+    uint32_t m_seed = 1;
+    int64_t m_max_shutdown_ms = 5000;
+    size_t m_pool_size = 48;
+
+    uint64_t m_period_usec;
+    std::chrono::steady_clock::time_point m_start;
+    std::deque<uint64_t> m_queue;
+    uint64_t m_produced = 0;
+    uint64_t m_dropped = 0;
+    uint64_t m_delivered = 0;
+    uint64_t m_imu_samples = 0;
+    std::mt19937 m_rng;
+    std::chrono::steady_clock::time_point m_next_arrival;
+
+    std::unique_ptr<ImagePool> m_color_pool;
+    std::unique_ptr<ImagePool> m_depth_pool;
+    std::unique_ptr<ImagePool> m_ir_pool;
+};
@@ -0,0 +1,144 @@
+#include "host_clock.h"
+
+#include <cmath>
+#include <ctime>
+
+#include <fmt/core.h>
+
+// forgetting factor per sample, about ten minutes of captures at 30 fps
+static const double host_clock_forgetting = 1.0 - 1.0 / 18000;
+// samples further above the fit than this many mean residuals (plus a floor) are rejected
+static const double host_clock_outlier_factor = 5.0;
+static const double host_clock_outlier_floor_usec = 200.0;
+// this many rejections in a row mean the device clock jumped
+static const uint64_t host_clock_max_rejected_in_row = 30;
+
+// POSIX clocks without a fallback, the recorder only builds on Linux
+static int64_t clock_nsec(clockid_t clock)
+{
+    timespec now;
+    clock_gettime(clock, &now);
+    return static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+uint64_t HostClockModel::add_capture(k4a_capture_t capture)
+{
+    int64_t monotonic = clock_nsec(CLOCK_MONOTONIC);
+    int64_t realtime = clock_nsec(CLOCK_REALTIME);
+    uint64_t device_usec = 0;
+    uint64_t arrival_nsec = 0;
+    k4a_image_t images[] = {k4a_capture_get_color_image(capture),
+                            k4a_capture_get_depth_image(capture),
+                            k4a_capture_get_ir_image(capture)};
+    for (k4a_image_t image : images)
+    {
+        if (image != nullptr)
+        {
+            if (device_usec == 0)
+            {
+                device_usec = k4a_image_get_device_timestamp_usec(image);
+                arrival_nsec = k4a_image_get_system_timestamp_nsec(image);
+            }
+            k4a_image_release(image);
+        }
+    }
+    if (device_usec == 0)
+    {
+        return 0;
+    }
+    // the SDK stamps arrival with CLOCK_MONOTONIC, the realtime offset is taken from our own pair
+    if (arrival_nsec != 0 && static_cast<int64_t>(arrival_nsec) <= monotonic)
+    {
+        realtime -= monotonic - static_cast<int64_t>(arrival_nsec);
+        monotonic = static_cast<int64_t>(arrival_nsec);
+    }
+    add_sample(device_usec, monotonic, realtime);
+    return device_usec;
+}
+
+void HostClockModel::reset(uint64_t device_usec, int64_t monotonic_nsec)
+{
+    m_started = true;
+    m_origin_device_usec = device_usec;
+    m_origin_monotonic_nsec = monotonic_nsec;
+    m_weight = 0;
+    m_mean_x = 0;
+    m_mean_y = 0;
+    m_cxx = 0;
+    m_cxy = 0;
+    m_residual_usec = 0;
+    m_samples = 0;
+    m_rejected_in_row = 0;
+}
+
+void HostClockModel::add_sample(uint64_t device_usec, int64_t monotonic_nsec, int64_t realtime_nsec)
+{
+    if (!m_started)
+    {
+        reset(device_usec, monotonic_nsec);
+    }
+    m_realtime_offset_nsec = realtime_nsec - monotonic_nsec;
+    double x = static_cast<double>(static_cast<int64_t>(device_usec - m_origin_device_usec));
+    double y = static_cast<double>(monotonic_nsec - m_origin_monotonic_nsec) / 1000.0;
+
+    if (valid())
+    {
+        double slope = m_cxy / m_cxx;
+        double residual = y - (m_mean_y + slope * (x - m_mean_x));
+        // latency only delays the host side, a sample below the fit is never an outlier
+        if (residual > host_clock_outlier_factor * m_residual_usec + host_clock_outlier_floor_usec)
+        {
+            ++m_rejected;
+            if (++m_rejected_in_row >= host_clock_max_rejected_in_row)
+            {
+                reset(device_usec, monotonic_nsec);
+                add_sample(device_usec, monotonic_nsec, realtime_nsec);
+            }
+            return;
+        }
+        m_residual_usec += (std::fabs(residual) - m_residual_usec) / 64;
+    }
+    m_rejected_in_row = 0;
+
+    m_weight = m_weight * host_clock_forgetting + 1;
+    m_cxx *= host_clock_forgetting;
+    m_cxy *= host_clock_forgetting;
+    double dx = x - m_mean_x;
+    m_mean_x += dx / m_weight;
+    m_mean_y += (y - m_mean_y) / m_weight;
+    m_cxx += dx * (x - m_mean_x);
+    m_cxy += dx * (y - m_mean_y);
+    ++m_samples;
+    if (m_samples == min_samples)
+    {
+        // seed the residual scale once the fit has settled
+        double slope = m_cxx > 0 ? m_cxy / m_cxx : 1.0;
+        m_residual_usec = std::fabs(y - (m_mean_y + slope * (x - m_mean_x)));
+    }
+}
+
+double HostClockModel::drift_ppm() const
+{
+    if (m_cxx <= 0)
+    {
+        return 0;
+    }
+    return (m_cxy / m_cxx - 1.0) * 1e6;
+}
+
+int64_t HostClockModel::monotonic_nsec(uint64_t device_usec) const
+{
+    double x = static_cast<double>(static_cast<int64_t>(device_usec - m_origin_device_usec));
+    double slope = m_cxx > 0 ? m_cxy / m_cxx : 1.0;
+    double y = m_mean_y + slope * (x - m_mean_x);
+    return m_origin_monotonic_nsec + static_cast<int64_t>(std::llround(y * 1000.0));
+}
+
+std::string HostClockModel::record(uint64_t device_usec) const
+{
+    int64_t monotonic = monotonic_nsec(device_usec);
+    return fmt::format("{{\"device_usec\":{},\"monotonic_nsec\":{},\"realtime_nsec\":{},\"drift_ppm\":{:.3f},"
+                       "\"residual_usec\":{:.1f},\"samples\":{},\"rejected\":{}}}",
+                       device_usec, monotonic, monotonic + m_realtime_offset_nsec, drift_ppm(), m_residual_usec,
+                       m_samples, m_rejected);
+}
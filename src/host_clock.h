@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <k4a/k4a.h>
+
+// Name of the subtitle track that carries the host clock model of a block.
+static const char *const host_clock_track_name = "HOST_CLOCK";
+
+// Online linear model host_monotonic = offset + (1 + drift) * device_time, fitted per capture.
+//
+// The host side of each sample is the SDK's arrival timestamp of the capture (CLOCK_MONOTONIC, taken
+// when the USB transfer completed), or the time the capture was dequeued if the SDK did not set one.
+// Both only ever add latency, so samples far above the fit (scheduling hiccups, recorder stalls) are
+// rejected against a running residual scale, samples below it are always kept. Older samples are
+// forgotten exponentially, which lets the model follow temperature dependent drift over long sessions.
+// A device reset restarts the device clock near zero and puts every later sample far above the fit, a
+// run of rejected samples restarts the fit.
+class HostClockModel
+{
+public:
+    // host to device lookup needs the model to have seen this many samples
+    static const uint64_t min_samples = 30;
+
+    // Sample the host clocks for a capture, costs two clock_gettime calls. Returns the device timestamp
+    // the sample was taken for, 0 if the capture has no images.
+    uint64_t add_capture(k4a_capture_t capture);
+    void add_sample(uint64_t device_usec, int64_t monotonic_nsec, int64_t realtime_nsec);
+
+    bool valid() const
+    {
+        return m_samples >= min_samples;
+    }
+
+    // Host CLOCK_MONOTONIC time of a device timestamp, in nanoseconds.
+    int64_t monotonic_nsec(uint64_t device_usec) const;
+
+    // One JSON line with the model anchored at device_usec: the monotonic and realtime host time of
+    // device_usec, the drift in ppm and the residual spread. A reader maps any device time t of the
+    // block to host time as monotonic_nsec + (t - device_usec) * 1000 * (1 + drift_ppm / 1e6).
+    std::string record(uint64_t device_usec) const;
+
+    double drift_ppm() const;
+    double residual_usec() const
+    {
+        return m_residual_usec;
+    }
+    uint64_t samples() const
+    {
+        return m_samples;
+    }
+    uint64_t rejected() const
+    {
+        return m_rejected;
+    }
+
+private:
+    void reset(uint64_t device_usec, int64_t monotonic_nsec);
+
+    // fit in microseconds relative to the first sample, keeps the sums small for double precision
+    bool m_started = false;
+    uint64_t m_origin_device_usec = 0;
+    int64_t m_origin_monotonic_nsec = 0;
+    double m_weight = 0;
+    double m_mean_x = 0;
+    double m_mean_y = 0;
+    double m_cxx = 0;
+    double m_cxy = 0;
+    // mean absolute residual of accepted samples
+    double m_residual_usec = 0;
+    uint64_t m_samples = 0;
+    uint64_t m_rejected = 0;
+    uint64_t m_rejected_in_row = 0;
+    // CLOCK_REALTIME - CLOCK_MONOTONIC at the last sample, follows NTP steps
+    int64_t m_realtime_offset_nsec = 0;
+};
@@ -0,0 +1,183 @@
+#include "image_codec.h"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+
+#include <jpeglib.h>
+
+namespace
+{
+// libjpeg reports errors through error_exit, which must not return
+struct jpeg_error_t
+{
+    jpeg_error_mgr manager;
+    jmp_buf jump;
+};
+
+void jpeg_error_exit(j_common_ptr info)
+{
+    longjmp(reinterpret_cast<jpeg_error_t *>(info->err)->jump, 1);
+}
+
+inline uint8_t clamp_u8(int value)
+{
+    return static_cast<uint8_t>(std::min(std::max(value, 0), 255));
+}
+
+// BT.601 limited range, fixed point with 8 fractional bits
+inline void yuv_to_rgb(int y, int u, int v, uint8_t *rgb)
+{
+    int c = (y - 16) * 298;
+    int d = u - 128;
+    int e = v - 128;
+    rgb[0] = clamp_u8((c + 409 * e + 128) >> 8);
+    rgb[1] = clamp_u8((c - 100 * d - 208 * e + 128) >> 8);
+    rgb[2] = clamp_u8((c + 516 * d + 128) >> 8);
+}
+} // namespace
+
+bool encode_jpeg(const std::vector<uint8_t> &rgb, int width, int height, int quality, std::vector<uint8_t> &jpeg)
+{
+    jpeg_compress_struct info;
+    jpeg_error_t error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpeg_error_exit;
+    unsigned char *out = nullptr;
+    unsigned long out_size = 0;
+    if (setjmp(error.jump))
+    {
+        jpeg_destroy_compress(&info);
+        std::free(out);
+        return false;
+    }
+    jpeg_create_compress(&info);
+    jpeg_mem_dest(&info, &out, &out_size);
+    info.image_width = static_cast<JDIMENSION>(width);
+    info.image_height = static_cast<JDIMENSION>(height);
+    info.input_components = 3;
+    info.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&info);
+    jpeg_set_quality(&info, quality, TRUE);
+    jpeg_start_compress(&info, TRUE);
+    while (info.next_scanline < info.image_height)
+    {
+        JSAMPROW row = const_cast<JSAMPROW>(&rgb[static_cast<size_t>(info.next_scanline) * width * 3]);
+        jpeg_write_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_compress(&info);
+    jpeg_destroy_compress(&info);
+    jpeg.assign(out, out + out_size);
+    std::free(out);
+    return true;
+}
+
+bool decode_jpeg_scaled(const uint8_t *data, size_t size, int scale, std::vector<uint8_t> &rgb, int &width, int &height)
+{
+    jpeg_decompress_struct info;
+    jpeg_error_t error;
+    info.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpeg_error_exit;
+    if (setjmp(error.jump))
+    {
+        jpeg_destroy_decompress(&info);
+        return false;
+    }
+    jpeg_create_decompress(&info);
+    jpeg_mem_src(&info, const_cast<unsigned char *>(data), static_cast<unsigned long>(size));
+    jpeg_read_header(&info, TRUE);
+    info.out_color_space = JCS_RGB;
+    info.scale_num = 1;
+    info.scale_denom = static_cast<unsigned int>(scale);
+    info.dct_method = JDCT_IFAST;
+    jpeg_start_decompress(&info);
+    width = static_cast<int>(info.output_width);
+    height = static_cast<int>(info.output_height);
+    rgb.resize(static_cast<size_t>(width) * height * 3);
+    while (info.output_scanline < info.output_height)
+    {
+        JSAMPROW row = &rgb[static_cast<size_t>(info.output_scanline) * width * 3];
+        jpeg_read_scanlines(&info, &row, 1);
+    }
+    jpeg_finish_decompress(&info);
+    jpeg_destroy_decompress(&info);
+    return true;
+}
+
+void scale_color(k4a_image_t image, int scale, std::vector<uint8_t> &rgb, int &width, int &height)
+{
+    k4a_image_format_t format = k4a_image_get_format(image);
+    const uint8_t *data = k4a_image_get_buffer(image);
+    int stride = k4a_image_get_stride_bytes(image);
+    int in_width = k4a_image_get_width_pixels(image);
+    int in_height = k4a_image_get_height_pixels(image);
+    width = in_width / scale;
+    height = in_height / scale;
+    rgb.resize(static_cast<size_t>(width) * height * 3);
+    std::vector<int> sum(static_cast<size_t>(width) * 3);
+    int area = scale * scale;
+
+    for (int oy = 0; oy < height; ++oy)
+    {
+        std::fill(sum.begin(), sum.end(), 0);
+        uint8_t *out = &rgb[static_cast<size_t>(oy) * width * 3];
+        if (format == K4A_IMAGE_FORMAT_COLOR_BGRA32)
+        {
+            for (int dy = 0; dy < scale; ++dy)
+            {
+                const uint8_t *row = data + static_cast<size_t>(oy * scale + dy) * stride;
+                for (int ox = 0; ox < width; ++ox)
+                {
+                    for (int dx = 0; dx < scale; ++dx)
+                    {
+                        const uint8_t *pixel = row + (ox * scale + dx) * 4;
+                        sum[ox * 3] += pixel[2];
+                        sum[ox * 3 + 1] += pixel[1];
+                        sum[ox * 3 + 2] += pixel[0];
+                    }
+                }
+            }
+            for (int i = 0; i < width * 3; ++i)
+            {
+                out[i] = static_cast<uint8_t>(sum[i] / area);
+            }
+            continue;
+        }
+
+        // luma average into sum[ox]
+        int luma_step = format == K4A_IMAGE_FORMAT_COLOR_YUY2 ? 2 : 1;
+        for (int dy = 0; dy < scale; ++dy)
+        {
+            const uint8_t *row = data + static_cast<size_t>(oy * scale + dy) * stride;
+            for (int ox = 0; ox < width; ++ox)
+            {
+                for (int dx = 0; dx < scale; ++dx)
+                {
+                    sum[ox] += row[(ox * scale + dx) * luma_step];
+                }
+            }
+        }
+        for (int ox = 0; ox < width; ++ox)
+        {
+            int x = ox * scale;
+            int y = oy * scale;
+            int u, v;
+            if (format == K4A_IMAGE_FORMAT_COLOR_YUY2)
+            {
+                const uint8_t *pair = data + static_cast<size_t>(y) * stride + (x & ~1) * 2;
+                u = pair[1];
+                v = pair[3];
+            }
+            else
+            {
+                // NV12, interleaved UV plane at half resolution below the luma plane
+                const uint8_t *chroma = data + static_cast<size_t>(in_height) * stride +
+                                        static_cast<size_t>(y / 2) * stride + (x & ~1);
+                u = chroma[0];
+                v = chroma[1];
+            }
+            yuv_to_rgb(sum[ox] / area, u, v, out + ox * 3);
+        }
+    }
+}
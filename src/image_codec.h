@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <k4a/k4a.h>
+
+// JPEG helpers shared by the proxy writer and atlas_export. All functions return false on corrupt input
+// instead of aborting, libjpeg errors are caught per call.
+
+// Encode a packed RGB image.
+bool encode_jpeg(const std::vector<uint8_t> &rgb, int width, int height, int quality, std::vector<uint8_t> &jpeg);
+
+// Decode a JPEG (MJPG color frame) into packed RGB at 1/scale of its size, scale is 1, 2, 4 or 8.
+// The scaling happens in the IDCT, so this is much cheaper than a full decode.
+bool decode_jpeg_scaled(const uint8_t *data, size_t size, int scale, std::vector<uint8_t> &rgb, int &width, int &height);
+
+// Convert an NV12, YUY2 or BGRA32 color image to packed RGB at 1/scale of its size. Luma (or BGR) is
+// averaged over each scale x scale block, chroma is taken from the block's first pixel.
+void scale_color(k4a_image_t image, int scale, std::vector<uint8_t> &rgb, int &width, int &height);
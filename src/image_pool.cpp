@@ -0,0 +1,121 @@
+#include "image_pool.h"
+#include "recorder.h"
+
+#include <cstdlib>
+
+// cache line alignment keeps the pixel loops of later stages on aligned loads
+static const size_t image_buffer_alignment = 64;
+
+static uint8_t *allocate_image_buffer(size_t size)
+{
+    size_t aligned_size = (size + image_buffer_alignment - 1) / image_buffer_alignment * image_buffer_alignment;
+    return static_cast<uint8_t *>(std::aligned_alloc(image_buffer_alignment, aligned_size));
+}
+
+ImagePool::ImagePool(k4a_image_format_t format, int width, int height, int stride, size_t size, size_t count) :
+    m_format(format),
+    m_width(width),
+    m_height(height),
+    m_stride(stride),
+    m_size(size),
+    m_state(new State)
+{
+    m_state->buffers.reserve(count);
+    m_state->free_buffers.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint8_t *buffer = allocate_image_buffer(size);
+        if (buffer == nullptr)
+        {
+            break;
+        }
+        m_state->buffers.push_back(buffer);
+        m_state->free_buffers.push_back(buffer);
+    }
+}
+
+ImagePool::~ImagePool()
+{
+    bool last;
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        m_state->pool_alive = false;
+        last = m_state->outstanding == 0;
+    }
+    if (last)
+    {
+        for (uint8_t *buffer : m_state->buffers)
+        {
+            std::free(buffer);
+        }
+        delete m_state;
+    }
+}
+
+k4a_image_t ImagePool::create_image(size_t size)
+{
+    if (size == 0 || size > m_size)
+    {
+        size = m_size;
+    }
+
+    uint8_t *buffer = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(m_state->mutex);
+        if (!m_state->free_buffers.empty())
+        {
+            buffer = m_state->free_buffers.back();
+            m_state->free_buffers.pop_back();
+            ++m_state->outstanding;
+        }
+    }
+
+    k4a_image_t image = nullptr;
+    if (buffer != nullptr)
+    {
+        if (K4A_FAILED(k4a_image_create_from_buffer(m_format, m_width, m_height, m_stride, buffer, size,
+                                                    release_buffer, m_state, &image)))
+        {
+            release_buffer(buffer, m_state);
+            return nullptr;
+        }
+        return image;
+    }
+
+    ++recording_stats.image_pool_exhausted;
+    buffer = allocate_image_buffer(size);
+    if (buffer == nullptr ||
+        K4A_FAILED(k4a_image_create_from_buffer(m_format, m_width, m_height, m_stride, buffer, size,
+                                                release_heap_buffer, nullptr, &image)))
+    {
+        std::free(buffer);
+        return nullptr;
+    }
+    return image;
+}
+
+void ImagePool::release_buffer(void *buffer, void *context)
+{
+    State *state = static_cast<State *>(context);
+    bool last;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        state->free_buffers.push_back(static_cast<uint8_t *>(buffer));
+        --state->outstanding;
+        last = !state->pool_alive && state->outstanding == 0;
+    }
+    if (last)
+    {
+        for (uint8_t *pool_buffer : state->buffers)
+        {
+            std::free(pool_buffer);
+        }
+        delete state;
+    }
+}
+
+void ImagePool::release_heap_buffer(void *buffer, void *context)
+{
+    (void)context;
+    std::free(buffer);
+}
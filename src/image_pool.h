@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <k4a/k4a.h>
+
+// Fixed number of preallocated buffers for images of one format and size.
+// Images are created with k4a_image_create_from_buffer and their buffer goes back to the pool when the
+// last reference is released, so producing frames does not touch the heap in steady state. When every
+// buffer is in use create_image falls back to a heap buffer and counts it in
+// recording_stats.image_pool_exhausted. Images may outlive the pool, the shared state is freed with the
+// last outstanding buffer.
+class ImagePool
+{
+public:
+    // size is the buffer size per image, for compressed formats the largest expected frame
+    ImagePool(k4a_image_format_t format, int width, int height, int stride, size_t size, size_t count);
+    ~ImagePool();
+    ImagePool(const ImagePool &) = delete;
+    ImagePool &operator=(const ImagePool &) = delete;
+
+    // Create an image of the pool format, size bytes of it are used (at most the pool buffer size,
+    // 0 for the full buffer). Returns nullptr only if the image could not be created at all.
+    k4a_image_t create_image(size_t size = 0);
+
+    size_t buffer_size() const
+    {
+        return m_size;
+    }
+
+private:
+    struct State
+    {
+        std::mutex mutex;
+        std::vector<uint8_t *> free_buffers;
+        std::vector<uint8_t *> buffers;
+        size_t outstanding = 0;
+        bool pool_alive = true;
+    };
+
+    static void release_buffer(void *buffer, void *context);
+    static void release_heap_buffer(void *buffer, void *context);
+
+    k4a_image_format_t m_format;
+    int m_width;
+    int m_height;
+    int m_stride;
+    size_t m_size;
+    State *m_state;
+};
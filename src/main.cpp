@@ -7,9 +7,9 @@
 #include "cmdparser.h"
 #include "assert.h"
 
-#if defined(_WIN32)
-#include <windows.h>
-#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/select.h>
 
 #include <iostream>
 #include <atomic>
@@ -18,33 +18,106 @@
 #include <csignal>
 #include <math.h>
 #include <filesystem>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <algorithm>
 
 #include "recorder.h"
+#include "checksum.h"
+#include "block_summary.h"
+#include "fault_injection.h"
+#include "option_spec.h"
+#include "device_probe.h"
 
 using namespace std::chrono;
 namespace fs = std::filesystem;
 
-static steady_clock::time_point exiting_timestamp;
+// The signal handler only records the request and wakes the shutdown watcher through a self-pipe,
+// everything else (logging, deadlines, forced exit) happens on the watcher thread.
+static int signal_pipe[2] = {-1, -1};
+static const char signal_byte = 's';
+static const char quit_byte = 'q';
 
 static void signal_handler(int s)
 {
     (void)s; // Unused
 
-    if (!exiting)
+    int saved_errno = errno;
+    request_stop();
+    if (write(signal_pipe[1], &signal_byte, 1) < 0)
     {
-        std::cout << "Stopping recording..." << std::endl;
-        exiting_timestamp = steady_clock::now();
-        exiting = true;
-        if (backup_thread.joinable()) {
-            std::cout <<"Terminating backup thread..." << std::endl;
-            backup_thread.join();
-        }
+        // nothing safe to do here, the exiting flag is already set
+    }
+    errno = saved_errno;
+}
+
+static void print_shutdown_report()
+{
+    std::cout << "Wrote " << recording_stats.frames_written << " frames, finalized "
+              << recording_stats.blocks_finalized << " of " << recording_stats.blocks_created << " blocks." << std::endl;
+    if (recording_stats.blocks_created > recording_stats.blocks_finalized)
+    {
+        std::cout << "Blocks that were not finalized remain as _temp_N.tmp files." << std::endl;
     }
-    // If Ctrl-C is received again after 1 second, force-stop the application since it's not responding.
-    else if (steady_clock::now() - exiting_timestamp > seconds(1))
+}
+
+static void shutdown_watcher(milliseconds shutdown_timeout)
+{
+    steady_clock::time_point exiting_timestamp;
+    bool stopping = false;
+    while (true)
     {
-        std::cout << "Forcing stop." << std::endl;
-        exit(1);
+        if (stopping)
+        {
+            // wait for a second signal until the shutdown deadline
+            auto remaining = exiting_timestamp + shutdown_timeout - steady_clock::now();
+            struct timeval tv;
+            auto remaining_us = std::max<int64_t>(0, duration_cast<microseconds>(remaining).count());
+            tv.tv_sec = static_cast<time_t>(remaining_us / 1000000);
+            tv.tv_usec = static_cast<suseconds_t>(remaining_us % 1000000);
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(signal_pipe[0], &fds);
+            int ready = select(signal_pipe[0] + 1, &fds, nullptr, nullptr, &tv);
+            if (ready == 0)
+            {
+                std::cout << "Shutdown did not complete within "
+                          << duration_cast<milliseconds>(shutdown_timeout).count() << "ms, forcing stop." << std::endl;
+                print_shutdown_report();
+                _exit(1);
+            }
+            if (ready < 0)
+            {
+                continue;
+            }
+        }
+
+        char c;
+        ssize_t n = read(signal_pipe[0], &c, 1);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0 || c == quit_byte)
+        {
+            return;
+        }
+
+        if (!stopping)
+        {
+            std::cout << "Stopping recording..." << std::endl;
+            exiting_timestamp = steady_clock::now();
+            stopping = true;
+        }
+        // If Ctrl-C is received again after 1 second, force-stop the application since it's not responding.
+        else if (steady_clock::now() - exiting_timestamp > seconds(1))
+        {
+            std::cout << "Forcing stop." << std::endl;
+            print_shutdown_report();
+            _exit(1);
+        }
     }
 }
 
@@ -70,42 +143,51 @@ static int string_compare(const char *s1, const char *s2)
     return (int)tolower((unsigned char)*s1) - (int)tolower((unsigned char)*s2);
 }
 
+// "x,y,width,height"
+static roi_t parse_roi(const char *arg)
+{
+    roi_t roi;
+    char extra;
+    if (std::sscanf(arg, "%d,%d,%d,%d%c", &roi.x, &roi.y, &roi.width, &roi.height, &extra) != 4 || roi.width <= 0 ||
+        roi.height <= 0)
+    {
+        throw std::runtime_error("Expected x,y,width,height, got: " + std::string(arg));
+    }
+    return roi;
+}
+
 [[noreturn]] static void list_devices()
 {
-    uint32_t device_count = k4a_device_get_installed_count();
-    if (device_count > 0)
+    std::vector<device_probe_t> probes = probe_devices();
+    if (!probes.empty())
     {
-        for (uint8_t i = 0; i < device_count; i++)
+        for (size_t i = 0; i < probes.size(); i++)
         {
-            std::cout << "Index:" << (int)i;
-            k4a_device_t device;
-            if (K4A_SUCCEEDED(k4a_device_open(i, &device)))
+            const device_probe_t &probe = probes[i];
+            std::cout << "Index:" << i;
+            if (probe.opened)
             {
-                char serial_number_buffer[256];
-                size_t serial_number_buffer_size = sizeof(serial_number_buffer);
-                if (k4a_device_get_serialnum(device, serial_number_buffer, &serial_number_buffer_size) ==
-                    K4A_BUFFER_RESULT_SUCCEEDED)
+                if (probe.serial_ok)
                 {
-                    std::cout << "\tSerial:" << serial_number_buffer;
+                    std::cout << "\tSerial:" << probe.info.serial_number;
                 }
                 else
                 {
                     std::cout << "\tSerial:ERROR";
                 }
 
-                k4a_hardware_version_t version_info;
-                if (K4A_SUCCEEDED(k4a_device_get_version(device, &version_info)))
+                const k4a_hardware_version_t &version_info = probe.info.version;
+                if (probe.version_ok)
                 {
                     std::cout << "\tColor:" << version_info.rgb.major << "." << version_info.rgb.minor << "."
                               << version_info.rgb.iteration;
                     std::cout << "\tDepth:" << version_info.depth.major << "." << version_info.depth.minor << "."
                               << version_info.depth.iteration;
                 }
-                k4a_device_close(device);
             }
             else
             {
-                std::cout << i << "\tDevice Open Failed";
+                std::cout << "\tDevice Open Failed";
             }
             std::cout << std::endl;
         }
@@ -117,6 +199,19 @@ static int string_compare(const char *s1, const char *s2)
     exit(0);
 }
 
+[[noreturn]] static void verify_blocks(const std::string &dir)
+{
+    unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+    int failures = verify_manifest(dir, num_threads);
+    exit(failures == 0 ? 0 : 1);
+}
+
+[[noreturn]] static void triage_blocks(const std::string &dir)
+{
+    int failures = triage_summaries(dir);
+    exit(failures == 0 ? 0 : 1);
+}
+
 int main(int argc, char **argv)
 {
     int device_index = 0;
@@ -134,6 +229,23 @@ int main(int argc, char **argv)
     uint32_t subordinate_delay_off_master_usec = 0;
     int absoluteExposureValue = defaultExposureAuto;
     int gain = defaultGainAuto;
+    bool record_checksums = true;
+    bool record_summaries = true;
+    bool record_host_clock = true;
+    std::string migrate_dir;
+    uint64_t migrate_bandwidth = 0;
+    std::string trace_file;
+    std::string simulate;
+    int shutdown_timeout_ms = 10000;
+    bool native_writer = false;
+    bool direct_io = false;
+    bool registered_depth = false;
+    uint32_t proxy_fps = 0;
+    uint32_t color_decimation = 1;
+    uint32_t depth_decimation = 1;
+    uint32_t ir_decimation = 1;
+    roi_t color_roi;
+    roi_t depth_roi;
     std::string base_filename;
 
     CmdParser::OptionParser cmd_parser;
@@ -143,6 +255,14 @@ int main(int argc, char **argv)
         exit(0);
     });
     cmd_parser.RegisterOption("--list", "List the currently connected K4A devices", list_devices);
+    cmd_parser.RegisterOption("--verify",
+                              "Verify all blocks in a recording directory against its checksum manifest",
+                              1,
+                              [&](const std::vector<char *> &args) { verify_blocks(args[0]); });
+    cmd_parser.RegisterOption("--triage",
+                              "Print per-block motion, saturation and depth coverage from the block summaries",
+                              1,
+                              [&](const std::vector<char *> &args) { triage_blocks(args[0]); });
     cmd_parser.RegisterOption("--device",
                               "Specify the device index to use (default: 0)",
                               1,
@@ -373,6 +493,199 @@ int main(int argc, char **argv)
                                   }
                                   gain = gainSetting;
                               });
+    cmd_parser.RegisterOption("--checksum",
+                              "Record a XXH3 checksum of every block in checksums.xxh3 (ON, OFF, default: ON)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  if (string_compare(args[0], "on") == 0)
+                                  {
+                                      record_checksums = true;
+                                  }
+                                  else if (string_compare(args[0], "off") == 0)
+                                  {
+                                      record_checksums = false;
+                                  }
+                                  else
+                                  {
+                                      std::ostringstream str;
+                                      str << "Unknown checksum mode specified: " << args[0];
+                                      throw std::runtime_error(str.str());
+                                  }
+                              });
+    cmd_parser.RegisterOption("--summary",
+                              "Record per-second content statistics of every block in <block>.summary\n"
+                              "(ON, OFF, default: ON)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  if (string_compare(args[0], "on") == 0)
+                                  {
+                                      record_summaries = true;
+                                  }
+                                  else if (string_compare(args[0], "off") == 0)
+                                  {
+                                      record_summaries = false;
+                                  }
+                                  else
+                                  {
+                                      std::ostringstream str;
+                                      str << "Unknown summary mode specified: " << args[0];
+                                      throw std::runtime_error(str.str());
+                                  }
+                              });
+    cmd_parser.RegisterOption("--host-clock",
+                              "Record a device to host clock model in a HOST_CLOCK track of every block\n"
+                              "(ON, OFF, default: ON)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  if (string_compare(args[0], "on") == 0)
+                                  {
+                                      record_host_clock = true;
+                                  }
+                                  else if (string_compare(args[0], "off") == 0)
+                                  {
+                                      record_host_clock = false;
+                                  }
+                                  else
+                                  {
+                                      std::ostringstream str;
+                                      str << "Unknown host clock mode specified: " << args[0];
+                                      throw std::runtime_error(str.str());
+                                  }
+                              });
+    cmd_parser.RegisterOption("--writer",
+                              "Block writer to use (K4ARECORD, NATIVE, default: K4ARECORD)\n"
+                              "NATIVE streams blocks through io_uring from preallocated buffers",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  if (string_compare(args[0], "k4arecord") == 0)
+                                  {
+                                      native_writer = false;
+                                  }
+                                  else if (string_compare(args[0], "native") == 0)
+                                  {
+                                      native_writer = true;
+                                  }
+                                  else
+                                  {
+                                      std::ostringstream str;
+                                      str << "Unknown writer specified: " << args[0];
+                                      throw std::runtime_error(str.str());
+                                  }
+                              });
+    cmd_parser.RegisterOption("--direct-io",
+                              "Write blocks with O_DIRECT, bypassing the page cache (native writer only)",
+                              [&]() { direct_io = true; });
+    cmd_parser.RegisterOption("--registered-depth",
+                              "Also record depth registered to the color camera in a REGISTERED_DEPTH track\n"
+                              "(ON, OFF, default: OFF)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  if (string_compare(args[0], "on") == 0)
+                                  {
+                                      registered_depth = true;
+                                  }
+                                  else if (string_compare(args[0], "off") == 0)
+                                  {
+                                      registered_depth = false;
+                                  }
+                                  else
+                                  {
+                                      std::ostringstream str;
+                                      str << "Unknown registered depth mode specified: " << args[0];
+                                      throw std::runtime_error(str.str());
+                                  }
+                              });
+    cmd_parser.RegisterOption("--proxy-fps",
+                              "Also write a low resolution <block>.proxy.mkv with this many frames per second\n"
+                              "for browsing (default: 0 = off)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  int fps = std::stoi(args[0]);
+                                  if (fps < 0 || fps > 30)
+                                  {
+                                      throw std::runtime_error("Proxy frame rate must be between 0 and 30.");
+                                  }
+                                  proxy_fps = static_cast<uint32_t>(fps);
+                              });
+    cmd_parser.RegisterOption("--decimate",
+                              "Write only every Nth frame of a stream, e.g. depth=6,ir=6 records depth and IR\n"
+                              "at 5 fps while color stays at 30 fps (keys: color, depth, ir, default: 1)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  std::map<std::string, double> values = parse_option_spec(args[0]);
+                                  double value;
+                                  uint32_t *targets[] = {&color_decimation, &depth_decimation, &ir_decimation};
+                                  const char *keys[] = {"color", "depth", "ir"};
+                                  for (size_t i = 0; i < 3; ++i)
+                                  {
+                                      if (take_option(values, keys[i], value))
+                                      {
+                                          if (value < 1 || value != std::floor(value))
+                                          {
+                                              throw std::runtime_error("Decimation must be a positive integer.");
+                                          }
+                                          *targets[i] = static_cast<uint32_t>(value);
+                                      }
+                                  }
+                                  check_no_options_left(values, "decimation");
+                              });
+    cmd_parser.RegisterOption("--color-roi",
+                              "Record only the rectangle x,y,width,height of the color image into a COLOR_ROI\n"
+                              "track (NV12, YUY2 and BGRA32 only)",
+                              1,
+                              [&](const std::vector<char *> &args) { color_roi = parse_roi(args[0]); });
+    cmd_parser.RegisterOption("--depth-roi",
+                              "Record only the rectangle x,y,width,height of depth and IR into DEPTH_ROI and\n"
+                              "IR_ROI tracks",
+                              1,
+                              [&](const std::vector<char *> &args) { depth_roi = parse_roi(args[0]); });
+    cmd_parser.RegisterOption("--migrate-to",
+                              "Move finalized blocks to this directory in the background (default: off)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  migrate_dir = args[0];
+                                  if (!fs::is_directory(migrate_dir))
+                                  {
+                                      throw std::runtime_error("Migration target must be an existing directory.");
+                                  }
+                              });
+    cmd_parser.RegisterOption("--migrate-bandwidth",
+                              "Limit the migration bandwidth in MB/s (default: 0 = unlimited)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  int bandwidth = std::stoi(args[0]);
+                                  if (bandwidth < 0)
+                                  {
+                                      throw std::runtime_error("Migration bandwidth must be positive.");
+                                  }
+                                  migrate_bandwidth = static_cast<uint64_t>(bandwidth) * 1024 * 1024;
+                              });
+    cmd_parser.RegisterOption("--trace",
+                              "Write a Chrome/Perfetto trace of per-frame latencies to this file at exit",
+                              1,
+                              [&](const std::vector<char *> &args) { trace_file = args[0]; });
+    cmd_parser.RegisterOption("--shutdown-timeout",
+                              "Time in ms to drain queued captures and finalize blocks after Ctrl-C (default: 10000)",
+                              1,
+                              [&](const std::vector<char *> &args) {
+                                  shutdown_timeout_ms = std::stoi(args[0]);
+                                  if (shutdown_timeout_ms <= 0)
+                                  {
+                                      throw std::runtime_error("Shutdown timeout must be positive.");
+                                  }
+                              });
+    cmd_parser.RegisterOption("--simulate",
+                              "Record from a synthetic frame source instead of a device and check the recorder\n"
+                              "invariants at exit, e.g. frames=900,jitter_ms=5,stall_every=300,stall_ms=200,buffer=2,seed=1",
+                              1,
+                              [&](const std::vector<char *> &args) { simulate = args[0]; });
+#if defined(ATLAS_FAULT_INJECTION)
+    cmd_parser.RegisterOption("--inject-faults",
+                              "Inject I/O faults, e.g. write_latency_ms=200,write_latency_rate=0.01,bandwidth_mb=20,\n"
+                              "flush_delay_ms=2000,enospc_after_mb=500,rename_fail_rate=0.1,seed=1",
+                              1,
+                              [&](const std::vector<char *> &args) { fault_injection_configure(args[0]); });
+#endif
 
     int args_left = 0;
     try
@@ -418,25 +731,19 @@ int main(int argc, char **argv)
         return 1;
     }
 
-#if defined(_WIN32)
-    SetConsoleCtrlHandler(
-        [](DWORD event) {
-            if (event == CTRL_C_EVENT || event == CTRL_BREAK_EVENT)
-            {
-                signal_handler(0);
-                return TRUE;
-            }
-            return FALSE;
-        },
-        true);
-#else
+    // the handler must never block on a full pipe, child processes must not inherit it
+    if (pipe2(signal_pipe, O_CLOEXEC) != 0 || fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK) != 0)
+    {
+        std::cerr << "Unable to create signal pipe: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
     struct sigaction act;
     act.sa_handler = signal_handler;
     sigemptyset(&act.sa_mask);
     act.sa_flags = 0;
     sigaction(SIGINT, &act, 0);
     sigaction(SIGTERM, &act, 0);
-#endif
+    std::thread watcher(shutdown_watcher, milliseconds(shutdown_timeout_ms));
     fs::path base_path(base_filename);
     fs::path dir = base_path.parent_path();
     if (!fs::exists(dir)) {
@@ -466,11 +773,41 @@ int main(int argc, char **argv)
     device_config.depth_delay_off_color_usec = depth_delay_off_color_usec;
     device_config.subordinate_delay_off_master_usec = subordinate_delay_off_master_usec;
 
-    return do_recording((uint8_t)device_index,
-                        base_filename,
-                        max_block_length,
-                        &device_config,
-                        recording_imu_enabled,
-                        absoluteExposureValue,
-                        gain);
+    recording_options_t recording_options;
+    recording_options.max_block_length = max_block_length;
+    recording_options.record_imu = recording_imu_enabled;
+    recording_options.absoluteExposureValue = absoluteExposureValue;
+    recording_options.gain = gain;
+    recording_options.record_checksums = record_checksums;
+    recording_options.record_summaries = record_summaries;
+    recording_options.record_host_clock = record_host_clock;
+    recording_options.migrate_dir = migrate_dir;
+    recording_options.migrate_bandwidth = migrate_bandwidth;
+    recording_options.trace_file = trace_file;
+    recording_options.simulate = simulate;
+    recording_options.shutdown_timeout_ms = shutdown_timeout_ms;
+    recording_options.native_writer = native_writer;
+    recording_options.direct_io = direct_io;
+    recording_options.registered_depth = registered_depth;
+    recording_options.proxy_fps = proxy_fps;
+    recording_options.color_decimation = color_decimation;
+    recording_options.depth_decimation = depth_decimation;
+    recording_options.ir_decimation = ir_decimation;
+    recording_options.color_roi = color_roi;
+    recording_options.depth_roi = depth_roi;
+
+    int result = do_recording((uint8_t)device_index,
+                              base_filename,
+                              &device_config,
+                              recording_options);
+
+    if (write(signal_pipe[1], &quit_byte, 1) == 1)
+    {
+        watcher.join();
+    }
+    else
+    {
+        watcher.detach();
+    }
+    return result;
 }
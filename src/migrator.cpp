@@ -0,0 +1,306 @@
+#include "migrator.h"
+#include "checksum.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+// ioprio constants from linux/ioprio.h, glibc does not provide a wrapper
+static const int ioprio_class_shift = 13;
+static const int ioprio_class_idle = 3;
+static const int ioprio_who_process = 1;
+
+static const uint64_t max_chunk_size = 16 * 1024 * 1024;
+static const uint64_t min_chunk_size = 1024 * 1024;
+// a backlog report pauses migration this long, the device queue only holds a few captures
+static const milliseconds capture_backlog_hold_off(2000);
+
+BlockMigrator::BlockMigrator(std::string target_dir, uint64_t bandwidth_bytes_per_sec) :
+    m_target_dir(std::move(target_dir)),
+    m_bandwidth(bandwidth_bytes_per_sec)
+{
+}
+
+BlockMigrator::~BlockMigrator()
+{
+    stop(steady_clock::now());
+}
+
+void BlockMigrator::start()
+{
+    m_stopping = false;
+    m_aborting = false;
+    m_running = true;
+    m_thread = std::thread(&BlockMigrator::run, this);
+}
+
+void BlockMigrator::stop(steady_clock::time_point drain_deadline)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_cv.notify_all();
+        if (!m_drained_cv.wait_until(lock, drain_deadline, [this]() { return !m_running; }))
+        {
+            m_aborting = true;
+            m_cv.notify_all();
+        }
+    }
+    if (m_thread.joinable())
+    {
+        m_thread.join();
+    }
+    for (const auto &job : m_queue)
+    {
+        std::cout << "Not migrated: " << job.path << std::endl;
+    }
+    m_queue.clear();
+}
+
+void BlockMigrator::enqueue(const std::string &path, bool has_digest, uint64_t digest)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(Job{path, has_digest, digest});
+    }
+    m_cv.notify_one();
+}
+
+void BlockMigrator::run()
+{
+    trace_set_thread_name("migrate");
+    // "who = process, which = 0" applies to the calling thread only
+    if (syscall(SYS_ioprio_set, ioprio_who_process, 0, ioprio_class_idle << ioprio_class_shift) != 0)
+    {
+        std::cerr << "Unable to set idle I/O priority for migration: " << std::strerror(errno) << std::endl;
+    }
+
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stopping || !m_queue.empty(); });
+            // on stop the queue is drained first, unless the deadline has already passed
+            if (m_aborting || m_queue.empty())
+            {
+                m_running = false;
+                m_drained_cv.notify_all();
+                return;
+            }
+            job = m_queue.front();
+            m_queue.pop_front();
+        }
+        TraceScope trace_migrate("block_migrate");
+        if (!migrate(job))
+        {
+            std::cerr << "Migration failed, block stays in place: " << job.path << std::endl;
+        }
+    }
+}
+
+bool BlockMigrator::migrate(const Job &job)
+{
+    fs::path src_path(job.path);
+    fs::path dst_path = fs::path(m_target_dir) / src_path.filename();
+    fs::path part_path = fs::path(m_target_dir) / ("." + src_path.filename().string() + ".part");
+
+    std::cout << "Migrating: " << job.path << " to " << dst_path.string() << std::endl;
+
+    // same filesystem, nothing to copy
+    if (std::rename(src_path.c_str(), dst_path.c_str()) == 0)
+    {
+        if (job.has_digest)
+        {
+            move_manifest_entry(src_path, job.digest);
+        }
+        return true;
+    }
+    if (errno != EXDEV)
+    {
+        std::cerr << "Unable to move " << job.path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    int src_fd = open(src_path.c_str(), O_RDONLY);
+    if (src_fd < 0)
+    {
+        std::cerr << "Unable to open " << job.path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(src_fd, &st) != 0)
+    {
+        close(src_fd);
+        return false;
+    }
+    posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int dst_fd = open(part_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst_fd < 0)
+    {
+        std::cerr << "Unable to create " << part_path.string() << ": " << std::strerror(errno) << std::endl;
+        close(src_fd);
+        return false;
+    }
+
+    bool ok = copy_file(src_fd, dst_fd, static_cast<uint64_t>(st.st_size)) && fsync(dst_fd) == 0;
+    close(dst_fd);
+    close(src_fd);
+
+    if (ok && std::rename(part_path.c_str(), dst_path.c_str()) != 0)
+    {
+        std::cerr << "Unable to rename " << part_path.string() << ": " << std::strerror(errno) << std::endl;
+        ok = false;
+    }
+    if (!ok)
+    {
+        unlink(part_path.c_str());
+        return false;
+    }
+
+    unlink(src_path.c_str());
+    if (job.has_digest)
+    {
+        move_manifest_entry(src_path, job.digest);
+    }
+    return true;
+}
+
+void BlockMigrator::move_manifest_entry(const fs::path &src_path, uint64_t digest)
+{
+    std::string name = src_path.filename().string();
+    if (!append_manifest_entry(m_target_dir, name, digest))
+    {
+        std::cerr << "Unable to write checksum manifest in " << m_target_dir << " for: " << name << std::endl;
+    }
+    // --verify on the capture directory would report the block as missing
+    if (!remove_manifest_entry(src_path.parent_path().string(), name))
+    {
+        std::cerr << "Unable to remove " << name << " from the checksum manifest of the capture directory."
+                  << std::endl;
+    }
+}
+
+void BlockMigrator::report_capture_backlog()
+{
+    auto until = steady_clock::now() + capture_backlog_hold_off;
+    m_backlog_until = duration_cast<nanoseconds>(until.time_since_epoch()).count();
+}
+
+bool BlockMigrator::capture_busy() const
+{
+    int64_t now = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    return m_capture_io > 0 || now < m_backlog_until;
+}
+
+bool BlockMigrator::copy_file(int src_fd, int dst_fd, uint64_t size)
+{
+    uint64_t chunk_size = max_chunk_size;
+    if (m_bandwidth > 0)
+    {
+        // keep at least ~10 throttle decisions per second
+        chunk_size = std::clamp(m_bandwidth / 10, min_chunk_size, max_chunk_size);
+    }
+
+    bool use_copy_file_range = true;
+    std::vector<char> buffer;
+    uint64_t copied = 0;
+
+    m_copy_start = steady_clock::now();
+    m_copy_bytes = 0;
+
+    while (copied < size)
+    {
+        if (m_aborting)
+        {
+            return false;
+        }
+        // back off while the recorder is flushing a block or falling behind, the capture disk belongs to it
+        if (capture_busy())
+        {
+            while (capture_busy() && !m_aborting)
+            {
+                std::this_thread::sleep_for(milliseconds(50));
+            }
+            m_copy_start = steady_clock::now();
+            m_copy_bytes = 0;
+        }
+
+        size_t len = static_cast<size_t>(std::min(chunk_size, size - copied));
+        ssize_t n = -1;
+        if (use_copy_file_range)
+        {
+            n = copy_file_range(src_fd, nullptr, dst_fd, nullptr, len, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                use_copy_file_range = false;
+            }
+        }
+        if (!use_copy_file_range)
+        {
+            buffer.resize(chunk_size);
+            n = read(src_fd, buffer.data(), len);
+            if (n > 0)
+            {
+                ssize_t written = 0;
+                while (written < n)
+                {
+                    ssize_t w = write(dst_fd, buffer.data() + written, n - written);
+                    if (w < 0)
+                    {
+                        if (errno == EINTR)
+                            continue;
+                        n = -1;
+                        break;
+                    }
+                    written += w;
+                }
+            }
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "Copy failed: " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        if (n == 0)
+        {
+            // source shrank underneath us
+            return false;
+        }
+        copied += n;
+        throttle(n);
+    }
+    return true;
+}
+
+void BlockMigrator::throttle(uint64_t bytes_copied)
+{
+    if (m_bandwidth == 0)
+    {
+        return;
+    }
+    m_copy_bytes += bytes_copied;
+    auto target = m_copy_start + microseconds(m_copy_bytes * 1000000 / m_bandwidth);
+    auto now = steady_clock::now();
+    if (target > now)
+    {
+        // stop() may abandon the copy while it waits
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait_until(lock, target, [this]() { return m_aborting.load(); });
+    }
+}
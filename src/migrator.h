@@ -0,0 +1,77 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Moves finalized blocks from the capture disk to bulk storage in the background.
+// The copy runs at idle I/O priority, is rate limited to bandwidth_bytes_per_sec (0 = unlimited)
+// and pauses while the recorder finalizes a block or reports that its capture queue is filling.
+class BlockMigrator
+{
+public:
+    BlockMigrator(std::string target_dir, uint64_t bandwidth_bytes_per_sec);
+    ~BlockMigrator();
+
+    void start();
+    // Migrate the blocks still queued, then stop. At drain_deadline the copy in progress is abandoned and
+    // the remaining blocks are left in place.
+    void stop(std::chrono::steady_clock::time_point drain_deadline);
+
+    // Queue a finalized block, digest is copied into the target manifest if has_digest is set.
+    void enqueue(const std::string &path, bool has_digest, uint64_t digest);
+
+    // Bracket recorder disk activity (block flushes), migration pauses while any is in progress.
+    void begin_capture_io()
+    {
+        ++m_capture_io;
+    }
+    void end_capture_io()
+    {
+        --m_capture_io;
+    }
+
+    // Captures wait in the device queue or frames were lost, migration holds off for a while after the
+    // last report so the capture disk can catch up.
+    void report_capture_backlog();
+
+private:
+    struct Job
+    {
+        std::string path;
+        bool has_digest;
+        uint64_t digest;
+    };
+
+    void run();
+    bool migrate(const Job &job);
+    // carry the checksum of a moved block from the capture to the target manifest
+    void move_manifest_entry(const std::filesystem::path &src_path, uint64_t digest);
+    bool capture_busy() const;
+    bool copy_file(int src_fd, int dst_fd, uint64_t size);
+    void throttle(uint64_t bytes_copied);
+
+    std::string m_target_dir;
+    uint64_t m_bandwidth;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_drained_cv;
+    std::deque<Job> m_queue;
+    bool m_running{false};
+    std::atomic_bool m_stopping{false};
+    std::atomic_bool m_aborting{false};
+    std::atomic<int> m_capture_io{0};
+    // steady_clock time in ns until which a capture backlog holds migration off
+    std::atomic<int64_t> m_backlog_until{0};
+
+    std::chrono::steady_clock::time_point m_copy_start;
+    uint64_t m_copy_bytes{0};
+};
@@ -0,0 +1,974 @@
+#include "mkv_writer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+#include <fmt/core.h>
+
+namespace
+{
+// Matroska element ids
+const uint32_t EBML_ID = 0x1A45DFA3;
+const uint32_t EBML_VERSION = 0x4286;
+const uint32_t EBML_READ_VERSION = 0x42F7;
+const uint32_t EBML_MAX_ID_LENGTH = 0x42F2;
+const uint32_t EBML_MAX_SIZE_LENGTH = 0x42F3;
+const uint32_t EBML_DOC_TYPE = 0x4282;
+const uint32_t EBML_DOC_TYPE_VERSION = 0x4287;
+const uint32_t EBML_DOC_TYPE_READ_VERSION = 0x4285;
+const uint32_t MKV_VOID = 0xEC;
+const uint32_t MKV_SEGMENT = 0x18538067;
+const uint32_t MKV_SEEK_HEAD = 0x114D9B74;
+const uint32_t MKV_SEEK = 0x4DBB;
+const uint32_t MKV_SEEK_ID = 0x53AB;
+const uint32_t MKV_SEEK_POSITION = 0x53AC;
+const uint32_t MKV_INFO = 0x1549A966;
+const uint32_t MKV_TIMECODE_SCALE = 0x2AD7B1;
+const uint32_t MKV_DURATION = 0x4489;
+const uint32_t MKV_MUXING_APP = 0x4D80;
+const uint32_t MKV_WRITING_APP = 0x5741;
+const uint32_t MKV_TRACKS = 0x1654AE6B;
+const uint32_t MKV_TRACK_ENTRY = 0xAE;
+const uint32_t MKV_TRACK_NUMBER = 0xD7;
+const uint32_t MKV_TRACK_UID = 0x73C5;
+const uint32_t MKV_TRACK_TYPE = 0x83;
+const uint32_t MKV_FLAG_LACING = 0x9C;
+const uint32_t MKV_NAME = 0x536E;
+const uint32_t MKV_CODEC_ID = 0x86;
+const uint32_t MKV_CODEC_PRIVATE = 0x63A2;
+const uint32_t MKV_DEFAULT_DURATION = 0x23E383;
+const uint32_t MKV_VIDEO = 0xE0;
+const uint32_t MKV_PIXEL_WIDTH = 0xB0;
+const uint32_t MKV_PIXEL_HEIGHT = 0xBA;
+const uint32_t MKV_CLUSTER = 0x1F43B675;
+const uint32_t MKV_TIMECODE = 0xE7;
+const uint32_t MKV_SIMPLE_BLOCK = 0xA3;
+const uint32_t MKV_CUES = 0x1C53BB6B;
+const uint32_t MKV_CUE_POINT = 0xBB;
+const uint32_t MKV_CUE_TIME = 0xB3;
+const uint32_t MKV_CUE_TRACK_POSITIONS = 0xB7;
+const uint32_t MKV_CUE_TRACK = 0xF7;
+const uint32_t MKV_CUE_CLUSTER_POSITION = 0xF1;
+const uint32_t MKV_ATTACHMENTS = 0x1941A469;
+const uint32_t MKV_ATTACHED_FILE = 0x61A7;
+const uint32_t MKV_FILE_NAME = 0x466E;
+const uint32_t MKV_FILE_MIME_TYPE = 0x4660;
+const uint32_t MKV_FILE_DATA = 0x465C;
+const uint32_t MKV_FILE_UID = 0x46AE;
+const uint32_t MKV_TAGS = 0x1254C367;
+const uint32_t MKV_TAG = 0x7373;
+const uint32_t MKV_TARGETS = 0x63C0;
+const uint32_t MKV_TARGET_TYPE_VALUE = 0x68CA;
+const uint32_t MKV_SIMPLE_TAG = 0x67C8;
+const uint32_t MKV_TAG_NAME = 0x45A3;
+const uint32_t MKV_TAG_STRING = 0x4487;
+
+const uint8_t TRACK_TYPE_VIDEO = 0x01;
+const uint8_t TRACK_TYPE_SUBTITLE = 0x11;
+
+// timecodes are in microseconds, same as the device timestamps
+const uint64_t timecode_scale_ns = 1000;
+// size of a cluster header: id, 8 byte size, timecode element with 8 byte value
+const size_t cluster_header_size = 4 + 8 + 2 + 8;
+// size of a SimpleBlock header: id, 8 byte size, track number, relative timecode, flags, lace count
+const size_t block_header_size = 1 + 8 + 1 + 2 + 1 + 1;
+const size_t imu_samples_per_block = 32;
+
+#pragma pack(push, 1)
+struct matroska_imu_sample_t
+{
+    uint64_t acc_timestamp_ns;
+    float acc_data[3];
+    uint64_t gyro_timestamp_ns;
+    float gyro_data[3];
+};
+#pragma pack(pop)
+
+void put_be(uint8_t *out, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i)
+    {
+        out[bytes - 1 - i] = static_cast<uint8_t>(value >> (8 * i));
+    }
+}
+
+void put_id(std::vector<uint8_t> &out, uint32_t id)
+{
+    size_t bytes = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+    for (size_t i = bytes; i > 0; --i)
+    {
+        out.push_back(static_cast<uint8_t>(id >> (8 * (i - 1))));
+    }
+}
+
+void put_size(std::vector<uint8_t> &out, uint64_t size)
+{
+    size_t bytes = 1;
+    while (bytes < 8 && size >= (uint64_t(1) << (7 * bytes)) - 1)
+    {
+        ++bytes;
+    }
+    size_t pos = out.size();
+    out.resize(pos + bytes);
+    put_be(&out[pos], size, bytes);
+    out[pos] |= static_cast<uint8_t>(0x80 >> (bytes - 1));
+}
+
+// 8 byte size, for elements that are patched once their size is known
+void put_size8(uint8_t *out, uint64_t size)
+{
+    put_be(out, size, 8);
+    out[0] = 0x01;
+}
+
+void put_uint(std::vector<uint8_t> &out, uint32_t id, uint64_t value, size_t bytes = 0)
+{
+    if (bytes == 0)
+    {
+        bytes = 1;
+        while (bytes < 8 && (value >> (8 * bytes)) != 0)
+        {
+            ++bytes;
+        }
+    }
+    put_id(out, id);
+    put_size(out, bytes);
+    size_t pos = out.size();
+    out.resize(pos + bytes);
+    put_be(&out[pos], value, bytes);
+}
+
+void put_binary(std::vector<uint8_t> &out, uint32_t id, const uint8_t *data, size_t size)
+{
+    put_id(out, id);
+    put_size(out, size);
+    out.insert(out.end(), data, data + size);
+}
+
+void put_string(std::vector<uint8_t> &out, uint32_t id, const std::string &value)
+{
+    put_binary(out, id, reinterpret_cast<const uint8_t *>(value.data()), value.size());
+}
+
+// returns the offset of the 8 byte double so it can be patched
+size_t put_float(std::vector<uint8_t> &out, uint32_t id, double value)
+{
+    put_id(out, id);
+    put_size(out, 8);
+    size_t pos = out.size();
+    out.resize(pos + 8);
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    put_be(&out[pos], bits, 8);
+    return pos;
+}
+
+// master elements get an 8 byte size that is filled in by end_master
+size_t begin_master(std::vector<uint8_t> &out, uint32_t id)
+{
+    put_id(out, id);
+    out.resize(out.size() + 8);
+    return out.size();
+}
+
+void end_master(std::vector<uint8_t> &out, size_t start)
+{
+    put_size8(&out[start - 8], out.size() - start);
+}
+
+// Void element of exactly length bytes, length must be at least 2
+void put_void(uint8_t *out, size_t length)
+{
+    out[0] = static_cast<uint8_t>(MKV_VOID);
+    if (length - 2 < 127)
+    {
+        out[1] = static_cast<uint8_t>(0x80 | (length - 2));
+        std::memset(out + 2, 0, length - 2);
+    }
+    else
+    {
+        put_size8(out + 1, length - 9);
+        std::memset(out + 9, 0, length - 9);
+    }
+}
+
+// padding needed after length bytes to reach the next alignment boundary with a Void element
+size_t void_padding(size_t length)
+{
+    size_t padding = (AsyncWriter::alignment - length % AsyncWriter::alignment) % AsyncWriter::alignment;
+    if (padding == 1)
+    {
+        padding += AsyncWriter::alignment;
+    }
+    return padding;
+}
+
+void pad_to_alignment(std::vector<uint8_t> &out)
+{
+    size_t padding = void_padding(out.size());
+    if (padding > 0)
+    {
+        out.resize(out.size() + padding);
+        put_void(&out[out.size() - padding], padding);
+    }
+}
+
+const char *color_format_name(k4a_image_format_t format)
+{
+    switch (format)
+    {
+    case K4A_IMAGE_FORMAT_COLOR_MJPG:
+        return "MJPG";
+    case K4A_IMAGE_FORMAT_COLOR_NV12:
+        return "NV12";
+    case K4A_IMAGE_FORMAT_COLOR_YUY2:
+        return "YUY2";
+    case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+        return "BGRA";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+const char *color_resolution_name(k4a_color_resolution_t resolution)
+{
+    switch (resolution)
+    {
+    case K4A_COLOR_RESOLUTION_720P:
+        return "720P";
+    case K4A_COLOR_RESOLUTION_1080P:
+        return "1080P";
+    case K4A_COLOR_RESOLUTION_1440P:
+        return "1440P";
+    case K4A_COLOR_RESOLUTION_1536P:
+        return "1536P";
+    case K4A_COLOR_RESOLUTION_2160P:
+        return "2160P";
+    case K4A_COLOR_RESOLUTION_3072P:
+        return "3072P";
+    default:
+        return "OFF";
+    }
+}
+
+const char *depth_mode_name(k4a_depth_mode_t mode)
+{
+    switch (mode)
+    {
+    case K4A_DEPTH_MODE_NFOV_2X2BINNED:
+        return "NFOV_2X2BINNED";
+    case K4A_DEPTH_MODE_NFOV_UNBINNED:
+        return "NFOV_UNBINNED";
+    case K4A_DEPTH_MODE_WFOV_2X2BINNED:
+        return "WFOV_2X2BINNED";
+    case K4A_DEPTH_MODE_WFOV_UNBINNED:
+        return "WFOV_UNBINNED";
+    case K4A_DEPTH_MODE_PASSIVE_IR:
+        return "PASSIVE_IR";
+    default:
+        return "OFF";
+    }
+}
+
+const char *wired_sync_mode_name(k4a_wired_sync_mode_t mode)
+{
+    switch (mode)
+    {
+    case K4A_WIRED_SYNC_MODE_MASTER:
+        return "MASTER";
+    case K4A_WIRED_SYNC_MODE_SUBORDINATE:
+        return "SUBORDINATE";
+    default:
+        return "STANDALONE";
+    }
+}
+
+// Largest capture the configuration can produce, a cluster buffer has to hold one of them.
+size_t max_capture_size(const k4a_device_configuration_t &config)
+{
+    int color_width, color_height, depth_width, depth_height;
+    k4a_color_resolution_to_size(config.color_resolution, color_width, color_height);
+    k4a_depth_mode_to_size(config.depth_mode, depth_width, depth_height);
+    size_t color_pixels = static_cast<size_t>(color_width) * color_height;
+    size_t depth_pixels = static_cast<size_t>(depth_width) * depth_height;
+
+    size_t size = 0;
+    switch (config.color_format)
+    {
+    case K4A_IMAGE_FORMAT_COLOR_NV12:
+        size += color_pixels * 3 / 2;
+        break;
+    case K4A_IMAGE_FORMAT_COLOR_YUY2:
+        size += color_pixels * 2;
+        break;
+    default:
+        // MJPG frames are well below 4 bytes per pixel
+        size += color_pixels * 4;
+        break;
+    }
+    size += depth_pixels * 2 * 2;
+    // headers, IMU blocks and custom track data
+    return size + (1 << 20);
+}
+
+const size_t writer_buffer_count = 4;
+} // namespace
+
+NativeMkvWriter::NativeMkvWriter(const k4a_device_configuration_t &config,
+                                 const device_info_t &device_info,
+                                 bool direct_io,
+                                 size_t extra_frame_size) :
+    m_config(config),
+    m_device_info(device_info),
+    m_writer(max_capture_size(config) + extra_frame_size, writer_buffer_count, direct_io),
+    m_uid_generator(std::random_device()())
+{
+}
+
+NativeMkvWriter::~NativeMkvWriter()
+{
+    close();
+}
+
+bool NativeMkvWriter::open(const std::string &path)
+{
+    if (!m_writer.open(path))
+    {
+        return false;
+    }
+    m_open = true;
+
+    int width, height;
+    if (m_config.color_resolution != K4A_COLOR_RESOLUTION_OFF)
+    {
+        k4a_color_resolution_to_size(m_config.color_resolution, width, height);
+        Track &color = add_track("COLOR", TRACK_TYPE_VIDEO, "V_MS/VFW/FOURCC");
+        color.width = width;
+        color.height = height;
+        switch (m_config.color_format)
+        {
+        case K4A_IMAGE_FORMAT_COLOR_NV12:
+            color.codec_private = bitmap_info_header(width, height, 12, "NV12");
+            break;
+        case K4A_IMAGE_FORMAT_COLOR_YUY2:
+            color.codec_private = bitmap_info_header(width, height, 16, "YUY2");
+            break;
+        case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+            color.codec_private = bitmap_info_header(width, height, 32, "\0\0\0\0");
+            break;
+        default:
+            color.codec_private = bitmap_info_header(width, height, 24, "MJPG");
+            break;
+        }
+    }
+    if (m_config.depth_mode != K4A_DEPTH_MODE_OFF)
+    {
+        k4a_depth_mode_to_size(m_config.depth_mode, width, height);
+        if (m_config.depth_mode != K4A_DEPTH_MODE_PASSIVE_IR)
+        {
+            Track &depth = add_track("DEPTH", TRACK_TYPE_VIDEO, "V_MS/VFW/FOURCC");
+            depth.width = width;
+            depth.height = height;
+            depth.codec_private = bitmap_info_header(width, height, 16, "b16g");
+        }
+        Track &ir = add_track("IR", TRACK_TYPE_VIDEO, "V_MS/VFW/FOURCC");
+        ir.width = width;
+        ir.height = height;
+        ir.codec_private = bitmap_info_header(width, height, 16, "b16g");
+    }
+    return true;
+}
+
+NativeMkvWriter::Track &NativeMkvWriter::add_track(const std::string &name, uint8_t type, const std::string &codec_id)
+{
+    Track track;
+    track.name = name;
+    track.number = m_tracks.size() + 1;
+    track.uid = m_uid_generator();
+    track.type = type;
+    track.codec_id = codec_id;
+    if (type == TRACK_TYPE_VIDEO)
+    {
+        track.default_duration_ns = 1000000000ull / k4a_convert_fps_to_uint(m_config.camera_fps);
+    }
+    m_tracks.push_back(track);
+    return m_tracks.back();
+}
+
+const NativeMkvWriter::Track *NativeMkvWriter::find_track(const std::string &name) const
+{
+    for (const auto &track : m_tracks)
+    {
+        if (track.name == name)
+        {
+            return &track;
+        }
+    }
+    return nullptr;
+}
+
+k4a_result_t NativeMkvWriter::add_tag(const char *name, const char *value)
+{
+    m_tags.emplace_back(name, value);
+    return K4A_RESULT_SUCCEEDED;
+}
+
+k4a_result_t NativeMkvWriter::add_imu_track()
+{
+    if (m_header_written || find_track("IMU") != nullptr)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    add_track("IMU", TRACK_TYPE_SUBTITLE, "S_K4A/IMU");
+    return K4A_RESULT_SUCCEEDED;
+}
+
+k4a_result_t NativeMkvWriter::add_custom_video_track(const char *track_name,
+                                                     const char *codec_id,
+                                                     const uint8_t *codec_context,
+                                                     size_t codec_context_size,
+                                                     const k4a_record_video_settings_t *track_settings)
+{
+    if (m_header_written || find_track(track_name) != nullptr)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    Track &track = add_track(track_name, TRACK_TYPE_VIDEO, codec_id);
+    track.codec_private.assign(codec_context, codec_context + codec_context_size);
+    track.width = track_settings->width;
+    track.height = track_settings->height;
+    track.default_duration_ns = track_settings->frame_rate > 0 ? 1000000000ull / track_settings->frame_rate : 0;
+    return K4A_RESULT_SUCCEEDED;
+}
+
+k4a_result_t NativeMkvWriter::add_custom_subtitle_track(const char *track_name,
+                                                        const char *codec_id,
+                                                        const uint8_t *codec_context,
+                                                        size_t codec_context_size,
+                                                        const k4a_record_subtitle_settings_t *)
+{
+    if (m_header_written || find_track(track_name) != nullptr)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    Track &track = add_track(track_name, TRACK_TYPE_SUBTITLE, codec_id);
+    track.codec_private.assign(codec_context, codec_context + codec_context_size);
+    return K4A_RESULT_SUCCEEDED;
+}
+
+std::vector<uint8_t> NativeMkvWriter::build_seek_head() const
+{
+    std::vector<std::pair<uint32_t, uint64_t>> entries = {{MKV_INFO, m_info_position},
+                                                          {MKV_TRACKS, m_tracks_position},
+                                                          {MKV_CUES, m_cues_position},
+                                                          {MKV_TAGS, m_tags_position}};
+    if (!m_device_info.raw_calibration.empty())
+    {
+        entries.emplace_back(MKV_ATTACHMENTS, m_attachments_position);
+    }
+
+    std::vector<uint8_t> out;
+    size_t seek_head = begin_master(out, MKV_SEEK_HEAD);
+    for (const auto &entry : entries)
+    {
+        size_t seek = begin_master(out, MKV_SEEK);
+        std::vector<uint8_t> id;
+        put_id(id, entry.first);
+        put_binary(out, MKV_SEEK_ID, id.data(), id.size());
+        // fixed width so the positions can be filled in at close
+        put_uint(out, MKV_SEEK_POSITION, entry.second, 8);
+        end_master(out, seek);
+    }
+    end_master(out, seek_head);
+    return out;
+}
+
+void NativeMkvWriter::build_header()
+{
+    std::vector<uint8_t> &out = m_header;
+    out.clear();
+
+    size_t ebml = begin_master(out, EBML_ID);
+    put_uint(out, EBML_VERSION, 1);
+    put_uint(out, EBML_READ_VERSION, 1);
+    put_uint(out, EBML_MAX_ID_LENGTH, 4);
+    put_uint(out, EBML_MAX_SIZE_LENGTH, 8);
+    put_string(out, EBML_DOC_TYPE, "matroska");
+    put_uint(out, EBML_DOC_TYPE_VERSION, 4);
+    put_uint(out, EBML_DOC_TYPE_READ_VERSION, 2);
+    end_master(out, ebml);
+
+    m_segment_size_offset = begin_master(out, MKV_SEGMENT) - 8;
+    m_segment_start = out.size();
+
+    m_seek_head_offset = out.size();
+    std::vector<uint8_t> seek_head = build_seek_head();
+    out.insert(out.end(), seek_head.begin(), seek_head.end());
+
+    m_info_position = out.size() - m_segment_start;
+    size_t info = begin_master(out, MKV_INFO);
+    put_uint(out, MKV_TIMECODE_SCALE, timecode_scale_ns);
+    m_duration_offset = put_float(out, MKV_DURATION, 0.0);
+    put_string(out, MKV_MUXING_APP, "atlas_recorder");
+    put_string(out, MKV_WRITING_APP, "atlas_recorder");
+    end_master(out, info);
+
+    m_tracks_position = out.size() - m_segment_start;
+    size_t tracks = begin_master(out, MKV_TRACKS);
+    for (const auto &track : m_tracks)
+    {
+        size_t entry = begin_master(out, MKV_TRACK_ENTRY);
+        put_uint(out, MKV_TRACK_NUMBER, track.number);
+        put_uint(out, MKV_TRACK_UID, track.uid);
+        put_uint(out, MKV_TRACK_TYPE, track.type);
+        put_uint(out, MKV_FLAG_LACING, track.type == TRACK_TYPE_SUBTITLE ? 1 : 0);
+        put_string(out, MKV_NAME, track.name);
+        put_string(out, MKV_CODEC_ID, track.codec_id);
+        if (!track.codec_private.empty())
+        {
+            put_binary(out, MKV_CODEC_PRIVATE, track.codec_private.data(), track.codec_private.size());
+        }
+        if (track.default_duration_ns > 0)
+        {
+            put_uint(out, MKV_DEFAULT_DURATION, track.default_duration_ns);
+        }
+        if (track.type == TRACK_TYPE_VIDEO)
+        {
+            size_t video = begin_master(out, MKV_VIDEO);
+            put_uint(out, MKV_PIXEL_WIDTH, track.width);
+            put_uint(out, MKV_PIXEL_HEIGHT, track.height);
+            end_master(out, video);
+        }
+        end_master(out, entry);
+    }
+    end_master(out, tracks);
+
+    if (!m_device_info.raw_calibration.empty())
+    {
+        m_attachments_position = out.size() - m_segment_start;
+        size_t attachments = begin_master(out, MKV_ATTACHMENTS);
+        size_t file = begin_master(out, MKV_ATTACHED_FILE);
+        put_string(out, MKV_FILE_NAME, "calibration.json");
+        put_string(out, MKV_FILE_MIME_TYPE, "application/octet-stream");
+        // the raw calibration is NUL terminated, the attachment is not
+        size_t size = m_device_info.raw_calibration.size();
+        while (size > 0 && m_device_info.raw_calibration[size - 1] == 0)
+        {
+            --size;
+        }
+        put_binary(out, MKV_FILE_DATA, m_device_info.raw_calibration.data(), size);
+        put_uint(out, MKV_FILE_UID, m_uid_generator());
+        end_master(out, file);
+        end_master(out, attachments);
+    }
+
+    pad_to_alignment(out);
+}
+
+k4a_result_t NativeMkvWriter::write_header()
+{
+    if (!m_open || m_header_written)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    build_header();
+    // written now so an interrupted block is still readable up to the last cluster, rewritten at close
+    if (!write_bytes(m_header, 0))
+    {
+        return K4A_RESULT_FAILED;
+    }
+    m_file_offset = m_header.size();
+    m_header_written = true;
+    return K4A_RESULT_SUCCEEDED;
+}
+
+bool NativeMkvWriter::write_bytes(std::vector<uint8_t> &data, uint64_t offset)
+{
+    for (size_t pos = 0; pos < data.size(); pos += m_writer.buffer_size())
+    {
+        uint8_t *buffer = m_writer.acquire();
+        if (buffer == nullptr)
+        {
+            return false;
+        }
+        size_t length = std::min(m_writer.buffer_size(), data.size() - pos);
+        std::memcpy(buffer, data.data() + pos, length);
+        if (!m_writer.submit(buffer, length, offset + pos))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool NativeMkvWriter::start_cluster(int64_t timecode)
+{
+    m_cluster = m_writer.acquire();
+    if (m_cluster == nullptr)
+    {
+        return false;
+    }
+    m_cluster_timecode = timecode;
+    m_cluster_has_video = false;
+
+    uint8_t *out = m_cluster;
+    put_be(out, MKV_CLUSTER, 4);
+    // size is filled in by finish_cluster
+    out[12] = static_cast<uint8_t>(MKV_TIMECODE);
+    out[13] = 0x88;
+    put_be(out + 14, static_cast<uint64_t>(timecode), 8);
+    m_cluster_length = cluster_header_size;
+    return true;
+}
+
+bool NativeMkvWriter::finish_cluster()
+{
+    if (m_cluster == nullptr)
+    {
+        return true;
+    }
+    put_size8(m_cluster + 4, m_cluster_length - 12);
+    size_t padding = void_padding(m_cluster_length);
+    if (padding > 0)
+    {
+        put_void(m_cluster + m_cluster_length, padding);
+    }
+    // late custom track data can start a cluster before the previous one, cues stay in time order
+    if (m_cluster_has_video && (m_cues.empty() || m_cluster_timecode > m_cues.back().first))
+    {
+        m_cues.emplace_back(m_cluster_timecode, m_file_offset - m_segment_start);
+    }
+
+    uint8_t *cluster = m_cluster;
+    m_cluster = nullptr;
+    size_t length = m_cluster_length + padding;
+    if (!m_writer.submit(cluster, length, m_file_offset))
+    {
+        return false;
+    }
+    m_file_offset += length;
+    return true;
+}
+
+uint8_t *NativeMkvWriter::begin_block(const Track &track, int64_t timecode, size_t payload_size, uint8_t lace_count)
+{
+    size_t block_size = block_header_size + payload_size - (lace_count > 1 ? 0 : 1);
+    // leave room for the Void element that pads the cluster
+    size_t usable = m_writer.buffer_size() - AsyncWriter::alignment - 2;
+    if (cluster_header_size + block_size > usable)
+    {
+        std::cerr << "Frame of " << payload_size << " bytes on track " << track.name
+                  << " does not fit into the write buffer." << std::endl;
+        return nullptr;
+    }
+
+    int64_t relative = timecode - m_cluster_timecode;
+    if (m_cluster == nullptr || m_cluster_length + block_size > usable || relative < INT16_MIN ||
+        relative > INT16_MAX)
+    {
+        if (!finish_cluster() || !start_cluster(timecode))
+        {
+            return nullptr;
+        }
+        relative = 0;
+    }
+
+    uint8_t *out = m_cluster + m_cluster_length;
+    out[0] = static_cast<uint8_t>(MKV_SIMPLE_BLOCK);
+    put_size8(out + 1, block_size - 9);
+    out[9] = static_cast<uint8_t>(0x80 | track.number);
+    put_be(out + 10, static_cast<uint16_t>(relative), 2);
+    // keyframe, fixed-size lacing when there is more than one frame
+    out[12] = lace_count > 1 ? 0x84 : 0x80;
+    size_t header = 13;
+    if (lace_count > 1)
+    {
+        out[13] = static_cast<uint8_t>(lace_count - 1);
+        header = 14;
+    }
+    m_cluster_length += block_size;
+    if (track.type == TRACK_TYPE_VIDEO)
+    {
+        m_cluster_has_video = true;
+    }
+    m_last_timecode = std::max(m_last_timecode, timecode);
+    return out + header;
+}
+
+bool NativeMkvWriter::write_image(const Track &track, k4a_image_t image)
+{
+    int64_t timecode = static_cast<int64_t>(k4a_image_get_device_timestamp_usec(image)) - m_start_offset_usec;
+    size_t size = k4a_image_get_size(image);
+    const uint8_t *data = k4a_image_get_buffer(image);
+    uint8_t *out = begin_block(track, std::max<int64_t>(timecode, 0), size, 1);
+    if (out == nullptr)
+    {
+        return false;
+    }
+    if (track.codec_private.size() >= 20 && std::memcmp(&track.codec_private[16], "b16g", 4) == 0)
+    {
+        // b16g is big endian
+        for (size_t i = 0; i + 1 < size; i += 2)
+        {
+            out[i] = data[i + 1];
+            out[i + 1] = data[i];
+        }
+    }
+    else
+    {
+        std::memcpy(out, data, size);
+    }
+    return true;
+}
+
+k4a_result_t NativeMkvWriter::write_capture(k4a_capture_t capture)
+{
+    if (!m_header_written)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    std::pair<k4a_image_t, const char *> images[] = {{k4a_capture_get_color_image(capture), "COLOR"},
+                                                     {k4a_capture_get_depth_image(capture), "DEPTH"},
+                                                     {k4a_capture_get_ir_image(capture), "IR"}};
+    if (m_start_offset_usec < 0)
+    {
+        for (const auto &image : images)
+        {
+            if (image.first != nullptr)
+            {
+                int64_t timestamp = static_cast<int64_t>(k4a_image_get_device_timestamp_usec(image.first));
+                if (m_start_offset_usec < 0 || timestamp < m_start_offset_usec)
+                {
+                    m_start_offset_usec = timestamp;
+                }
+            }
+        }
+    }
+
+    // every capture starts a new cluster, which makes each of them a seek point
+    bool ok = flush_imu() && finish_cluster();
+    for (const auto &image : images)
+    {
+        if (image.first == nullptr)
+        {
+            continue;
+        }
+        const Track *track = find_track(image.second);
+        if (ok && track != nullptr)
+        {
+            ok = write_image(*track, image.first);
+        }
+        k4a_image_release(image.first);
+    }
+    return ok ? K4A_RESULT_SUCCEEDED : K4A_RESULT_FAILED;
+}
+
+bool NativeMkvWriter::flush_imu()
+{
+    if (m_imu_sample_count == 0)
+    {
+        return true;
+    }
+    const Track *track = find_track("IMU");
+    uint8_t *out = begin_block(*track, m_imu_timecode, m_imu_samples.size(), static_cast<uint8_t>(m_imu_sample_count));
+    if (out == nullptr)
+    {
+        return false;
+    }
+    std::memcpy(out, m_imu_samples.data(), m_imu_samples.size());
+    m_imu_samples.clear();
+    m_imu_sample_count = 0;
+    return true;
+}
+
+k4a_result_t NativeMkvWriter::write_imu_sample(k4a_imu_sample_t imu_sample)
+{
+    if (!m_header_written || find_track("IMU") == nullptr)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    int64_t timecode = static_cast<int64_t>(imu_sample.acc_timestamp_usec) - m_start_offset_usec;
+    if (m_start_offset_usec < 0 || timecode < 0)
+    {
+        // samples from before the first capture of the block
+        return K4A_RESULT_SUCCEEDED;
+    }
+
+    matroska_imu_sample_t sample;
+    sample.acc_timestamp_ns = imu_sample.acc_timestamp_usec * 1000;
+    sample.gyro_timestamp_ns = imu_sample.gyro_timestamp_usec * 1000;
+    for (int i = 0; i < 3; ++i)
+    {
+        sample.acc_data[i] = imu_sample.acc_sample.v[i];
+        sample.gyro_data[i] = imu_sample.gyro_sample.v[i];
+    }
+    if (m_imu_sample_count == 0)
+    {
+        m_imu_timecode = timecode;
+    }
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&sample);
+    m_imu_samples.insert(m_imu_samples.end(), bytes, bytes + sizeof(sample));
+    if (++m_imu_sample_count == imu_samples_per_block)
+    {
+        return flush_imu() ? K4A_RESULT_SUCCEEDED : K4A_RESULT_FAILED;
+    }
+    return K4A_RESULT_SUCCEEDED;
+}
+
+k4a_result_t NativeMkvWriter::write_custom_track_data(const char *track_name,
+                                                      uint64_t device_timestamp_usec,
+                                                      uint8_t *custom_data,
+                                                      size_t custom_data_size)
+{
+    const Track *track = find_track(track_name);
+    if (!m_header_written || track == nullptr)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    if (m_start_offset_usec < 0)
+    {
+        m_start_offset_usec = static_cast<int64_t>(device_timestamp_usec);
+    }
+    int64_t timecode = std::max<int64_t>(static_cast<int64_t>(device_timestamp_usec) - m_start_offset_usec, 0);
+    uint8_t *out = begin_block(*track, timecode, custom_data_size, 1);
+    if (out == nullptr)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    std::memcpy(out, custom_data, custom_data_size);
+    return K4A_RESULT_SUCCEEDED;
+}
+
+k4a_result_t NativeMkvWriter::flush()
+{
+    if (!m_header_written)
+    {
+        return K4A_RESULT_FAILED;
+    }
+    if (!flush_imu() || !finish_cluster() || !m_writer.drain())
+    {
+        return K4A_RESULT_FAILED;
+    }
+    return K4A_RESULT_SUCCEEDED;
+}
+
+k4a_result_t NativeMkvWriter::close()
+{
+    if (!m_open)
+    {
+        return K4A_RESULT_SUCCEEDED;
+    }
+    m_open = false;
+    if (!m_header_written || K4A_FAILED(flush()))
+    {
+        m_writer.close();
+        return K4A_RESULT_FAILED;
+    }
+
+    // cues and tags after the last cluster
+    std::vector<uint8_t> tail;
+    m_cues_position = m_file_offset - m_segment_start;
+    size_t cues = begin_master(tail, MKV_CUES);
+    for (const auto &cue : m_cues)
+    {
+        size_t point = begin_master(tail, MKV_CUE_POINT);
+        put_uint(tail, MKV_CUE_TIME, static_cast<uint64_t>(cue.first));
+        size_t position = begin_master(tail, MKV_CUE_TRACK_POSITIONS);
+        put_uint(tail, MKV_CUE_TRACK, 1);
+        put_uint(tail, MKV_CUE_CLUSTER_POSITION, cue.second);
+        end_master(tail, position);
+        end_master(tail, point);
+    }
+    end_master(tail, cues);
+
+    std::vector<std::pair<std::string, std::string>> tags;
+    const char *track_tags[][2] = {{"COLOR", "K4A_COLOR_TRACK"},
+                                   {"DEPTH", "K4A_DEPTH_TRACK"},
+                                   {"IR", "K4A_IR_TRACK"},
+                                   {"IMU", "K4A_IMU_TRACK"}};
+    for (const auto &track_tag : track_tags)
+    {
+        const Track *track = find_track(track_tag[0]);
+        if (track != nullptr)
+        {
+            tags.emplace_back(track_tag[1], std::to_string(track->uid));
+        }
+    }
+    if (m_config.color_resolution != K4A_COLOR_RESOLUTION_OFF)
+    {
+        tags.emplace_back("K4A_COLOR_MODE",
+                          fmt::format("{}_{}", color_format_name(m_config.color_format),
+                                      color_resolution_name(m_config.color_resolution)));
+    }
+    if (m_config.depth_mode != K4A_DEPTH_MODE_OFF)
+    {
+        tags.emplace_back("K4A_DEPTH_MODE", depth_mode_name(m_config.depth_mode));
+        tags.emplace_back("K4A_IR_MODE", m_config.depth_mode == K4A_DEPTH_MODE_PASSIVE_IR ? "PASSIVE" : "ACTIVE");
+    }
+    if (find_track("IMU") != nullptr)
+    {
+        tags.emplace_back("K4A_IMU_MODE", "ON");
+    }
+    if (!m_device_info.raw_calibration.empty())
+    {
+        tags.emplace_back("K4A_CALIBRATION_FILE", "calibration.json");
+    }
+    tags.emplace_back("K4A_DEPTH_DELAY_NS", std::to_string(int64_t(m_config.depth_delay_off_color_usec) * 1000));
+    tags.emplace_back("K4A_WIRED_SYNC_MODE", wired_sync_mode_name(m_config.wired_sync_mode));
+    tags.emplace_back("K4A_SUBORDINATE_DELAY_NS",
+                      std::to_string(uint64_t(m_config.subordinate_delay_off_master_usec) * 1000));
+    const k4a_hardware_version_t &version = m_device_info.version;
+    tags.emplace_back("K4A_COLOR_FIRMWARE_VERSION",
+                      fmt::format("{}.{}.{}", version.rgb.major, version.rgb.minor, version.rgb.iteration));
+    tags.emplace_back("K4A_DEPTH_FIRMWARE_VERSION",
+                      fmt::format("{}.{}.{}", version.depth.major, version.depth.minor, version.depth.iteration));
+    if (!m_device_info.serial_number.empty())
+    {
+        tags.emplace_back("K4A_DEVICE_SERIAL_NUMBER", m_device_info.serial_number);
+    }
+    tags.emplace_back("K4A_START_OFFSET_NS", std::to_string(std::max<int64_t>(m_start_offset_usec, 0) * 1000));
+    tags.insert(tags.end(), m_tags.begin(), m_tags.end());
+
+    m_tags_position = m_cues_position + tail.size();
+    size_t tags_element = begin_master(tail, MKV_TAGS);
+    size_t tag = begin_master(tail, MKV_TAG);
+    size_t targets = begin_master(tail, MKV_TARGETS);
+    put_uint(tail, MKV_TARGET_TYPE_VALUE, 50);
+    end_master(tail, targets);
+    for (const auto &entry : tags)
+    {
+        size_t simple_tag = begin_master(tail, MKV_SIMPLE_TAG);
+        put_string(tail, MKV_TAG_NAME, entry.first);
+        put_string(tail, MKV_TAG_STRING, entry.second);
+        end_master(tail, simple_tag);
+    }
+    end_master(tail, tag);
+    end_master(tail, tags_element);
+    pad_to_alignment(tail);
+
+    bool ok = write_bytes(tail, m_file_offset);
+    m_file_offset += tail.size();
+
+    // patch the header now that sizes and positions are known
+    put_size8(&m_header[m_segment_size_offset], m_file_offset - m_segment_start);
+    std::vector<uint8_t> seek_head = build_seek_head();
+    std::copy(seek_head.begin(), seek_head.end(), m_header.begin() + m_seek_head_offset);
+    double duration = static_cast<double>(m_last_timecode);
+    const Track *timing_track = m_tracks.empty() ? nullptr : &m_tracks.front();
+    if (timing_track != nullptr && timing_track->default_duration_ns > 0)
+    {
+        duration += static_cast<double>(timing_track->default_duration_ns / timecode_scale_ns);
+    }
+    uint64_t bits;
+    std::memcpy(&bits, &duration, sizeof(bits));
+    put_be(&m_header[m_duration_offset], bits, 8);
+    ok = ok && write_bytes(m_header, 0);
+
+    if (!m_writer.close() || !ok)
+    {
+        std::cerr << "Runtime error: writing recording block failed." << std::endl;
+        return K4A_RESULT_FAILED;
+    }
+    return K4A_RESULT_SUCCEEDED;
+}
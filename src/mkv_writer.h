@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "async_writer.h"
+#include "block_writer.h"
+#include "recorder.h"
+
+// Streaming Matroska writer for recording blocks, a drop-in for libk4arecord.
+//
+// Each capture becomes its own cluster that is assembled directly in an AsyncWriter buffer and
+// padded with a Void element to a multiple of AsyncWriter::alignment, so the capture thread only
+// copies image data and never waits for the disk. Everything whose size is unknown while recording
+// (segment size, duration, seek positions) has a fixed width in the header, which is patched at
+// close. Cues and tags follow the last cluster. Track names, codecs and K4A_* tags follow the
+// k4arecord layout so blocks can be read with k4a_playback_open.
+class NativeMkvWriter : public BlockWriter
+{
+public:
+    // extra_frame_size: bytes of custom track data written per capture, clusters are sized to hold them
+    NativeMkvWriter(const k4a_device_configuration_t &config,
+                    const device_info_t &device_info,
+                    bool direct_io,
+                    size_t extra_frame_size = 0);
+    ~NativeMkvWriter() override;
+
+    bool open(const std::string &path);
+
+    k4a_result_t add_tag(const char *name, const char *value) override;
+    k4a_result_t add_imu_track() override;
+    k4a_result_t add_custom_video_track(const char *track_name,
+                                        const char *codec_id,
+                                        const uint8_t *codec_context,
+                                        size_t codec_context_size,
+                                        const k4a_record_video_settings_t *track_settings) override;
+    k4a_result_t add_custom_subtitle_track(const char *track_name,
+                                           const char *codec_id,
+                                           const uint8_t *codec_context,
+                                           size_t codec_context_size,
+                                           const k4a_record_subtitle_settings_t *track_settings) override;
+    k4a_result_t write_header() override;
+    k4a_result_t write_capture(k4a_capture_t capture) override;
+    k4a_result_t write_imu_sample(k4a_imu_sample_t imu_sample) override;
+    k4a_result_t write_custom_track_data(const char *track_name,
+                                         uint64_t device_timestamp_usec,
+                                         uint8_t *custom_data,
+                                         size_t custom_data_size) override;
+    k4a_result_t flush() override;
+    k4a_result_t close() override;
+
+private:
+    struct Track
+    {
+        std::string name;
+        uint64_t number;
+        uint64_t uid;
+        uint8_t type;
+        std::string codec_id;
+        std::vector<uint8_t> codec_private;
+        uint64_t width = 0;
+        uint64_t height = 0;
+        uint64_t default_duration_ns = 0;
+    };
+
+    Track &add_track(const std::string &name, uint8_t type, const std::string &codec_id);
+    const Track *find_track(const std::string &name) const;
+
+    // Reserve room for a SimpleBlock in the current cluster and write its header, starting a new
+    // cluster if needed. Returns where the payload goes, nullptr on failure.
+    uint8_t *begin_block(const Track &track, int64_t timecode, size_t payload_size, uint8_t lace_count);
+    bool start_cluster(int64_t timecode);
+    bool finish_cluster();
+    bool flush_imu();
+    bool write_image(const Track &track, k4a_image_t image);
+    // write a padded element sequence at the current file offset
+    bool write_bytes(std::vector<uint8_t> &data, uint64_t offset);
+    std::vector<uint8_t> build_seek_head() const;
+    void build_header();
+
+    k4a_device_configuration_t m_config;
+    device_info_t m_device_info;
+    AsyncWriter m_writer;
+    bool m_open = false;
+    bool m_header_written = false;
+    std::mt19937_64 m_uid_generator;
+
+    std::vector<Track> m_tracks;
+    std::vector<std::pair<std::string, std::string>> m_tags;
+
+    std::vector<uint8_t> m_header;
+    size_t m_segment_size_offset = 0;
+    size_t m_seek_head_offset = 0;
+    size_t m_duration_offset = 0;
+    uint64_t m_segment_start = 0;
+    uint64_t m_info_position = 0;
+    uint64_t m_tracks_position = 0;
+    uint64_t m_attachments_position = 0;
+    uint64_t m_cues_position = 0;
+    uint64_t m_tags_position = 0;
+    uint64_t m_file_offset = 0;
+
+    // cluster being assembled
+    uint8_t *m_cluster = nullptr;
+    size_t m_cluster_length = 0;
+    int64_t m_cluster_timecode = 0;
+    bool m_cluster_has_video = false;
+    // (timecode, cluster position) for every cluster that starts with a video frame
+    std::vector<std::pair<int64_t, uint64_t>> m_cues;
+
+    // device timestamp of the first capture, timecodes are relative to it
+    int64_t m_start_offset_usec = -1;
+    int64_t m_last_timecode = 0;
+
+    std::vector<uint8_t> m_imu_samples;
+    size_t m_imu_sample_count = 0;
+    int64_t m_imu_timecode = 0;
+};
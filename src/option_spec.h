@@ -0,0 +1,56 @@
+#pragma once
+
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// Parse a "key=value,key=value" list of numeric settings as used by --simulate and --inject-faults.
+inline std::map<std::string, double> parse_option_spec(const std::string &spec)
+{
+    std::map<std::string, double> values;
+    std::istringstream split(spec);
+    std::string item;
+    while (std::getline(split, item, ','))
+    {
+        if (item.empty())
+        {
+            continue;
+        }
+        size_t eq = item.find('=');
+        if (eq == std::string::npos || eq == 0 || eq + 1 == item.size())
+        {
+            throw std::runtime_error("Expected key=value, got: " + item);
+        }
+        try
+        {
+            values[item.substr(0, eq)] = std::stod(item.substr(eq + 1));
+        }
+        catch (const std::logic_error &)
+        {
+            throw std::runtime_error("Invalid number in: " + item);
+        }
+    }
+    return values;
+}
+
+// Take key out of values if present, so leftover keys can be reported as unknown.
+inline bool take_option(std::map<std::string, double> &values, const char *key, double &value)
+{
+    auto it = values.find(key);
+    if (it == values.end())
+    {
+        return false;
+    }
+    value = it->second;
+    values.erase(it);
+    return true;
+}
+
+inline void check_no_options_left(const std::map<std::string, double> &values, const char *what)
+{
+    if (!values.empty())
+    {
+        throw std::runtime_error(std::string("Unknown ") + what + " setting: " + values.begin()->first);
+    }
+}
@@ -0,0 +1,347 @@
+#include "proxy_writer.h"
+#include "image_codec.h"
+#include "recorder.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+// proxy color is scaled down by 1, 2, 4 or 8 to the smallest size that is at least this wide
+static const int proxy_min_color_width = 320;
+static const int proxy_jpeg_quality = 75;
+
+namespace
+{
+// Decimate a 16 bit image by proxy_decimation into big endian samples. With skip_zero, zero pixels
+// (no depth measurement) are left out of the average, a block without valid pixels stays zero.
+void decimate_16(k4a_image_t image, bool skip_zero, std::vector<uint8_t> &out)
+{
+    const uint8_t *data = k4a_image_get_buffer(image);
+    int stride = k4a_image_get_stride_bytes(image);
+    int width = k4a_image_get_width_pixels(image) / proxy_decimation;
+    int height = k4a_image_get_height_pixels(image) / proxy_decimation;
+    out.resize(static_cast<size_t>(width) * height * 2);
+    std::vector<uint32_t> sum(static_cast<size_t>(width));
+    std::vector<uint32_t> count(static_cast<size_t>(width));
+
+    for (int oy = 0; oy < height; ++oy)
+    {
+        std::fill(sum.begin(), sum.end(), 0);
+        std::fill(count.begin(), count.end(), 0);
+        for (int dy = 0; dy < proxy_decimation; ++dy)
+        {
+            const uint16_t *row =
+                reinterpret_cast<const uint16_t *>(data + static_cast<size_t>(oy * proxy_decimation + dy) * stride);
+            for (int ox = 0; ox < width; ++ox)
+            {
+                for (int dx = 0; dx < proxy_decimation; ++dx)
+                {
+                    uint16_t value = row[ox * proxy_decimation + dx];
+                    sum[ox] += value;
+                    count[ox] += skip_zero ? (value != 0) : 1;
+                }
+            }
+        }
+        uint8_t *out_row = &out[static_cast<size_t>(oy) * width * 2];
+        for (int ox = 0; ox < width; ++ox)
+        {
+            uint32_t value = sum[ox] / std::max<uint32_t>(count[ox], 1);
+            out_row[ox * 2] = static_cast<uint8_t>(value >> 8);
+            out_row[ox * 2 + 1] = static_cast<uint8_t>(value);
+        }
+    }
+}
+} // namespace
+
+ProxyWriter::ProxyWriter(const k4a_device_configuration_t &config, const device_info_t &device_info, uint32_t fps) :
+    m_config(config),
+    m_device_info(device_info),
+    m_period_usec(1000000 / std::max<uint32_t>(fps, 1))
+{
+    k4a_color_resolution_to_size(config.color_resolution, m_color_width, m_color_height);
+    while (m_color_scale < 8 && m_color_width / (m_color_scale * 2) >= proxy_min_color_width)
+    {
+        m_color_scale *= 2;
+    }
+    if (config.depth_mode != K4A_DEPTH_MODE_OFF)
+    {
+        k4a_depth_mode_to_size(config.depth_mode, m_depth_width, m_depth_height);
+    }
+    for (unsigned i = 0; i < worker_count; ++i)
+    {
+        m_workers.emplace_back(&ProxyWriter::run, this);
+    }
+}
+
+ProxyWriter::~ProxyWriter()
+{
+    finish(false);
+}
+
+bool ProxyWriter::open(const std::string &block_path)
+{
+    fs::path path(block_path);
+    m_path = (path.parent_path() / (path.stem().string() + proxy_file_suffix)).string();
+    m_part_path = m_path + ".tmp";
+
+    // only custom tracks, the proxy must not claim the COLOR/DEPTH/IR tracks of a K4A recording
+    k4a_device_configuration_t proxy_config = m_config;
+    proxy_config.color_resolution = K4A_COLOR_RESOLUTION_OFF;
+    proxy_config.depth_mode = K4A_DEPTH_MODE_OFF;
+    int color_width = m_color_width / m_color_scale;
+    int color_height = m_color_height / m_color_scale;
+    int depth_width = m_depth_width / proxy_decimation;
+    int depth_height = m_depth_height / proxy_decimation;
+    size_t frame_size = static_cast<size_t>(color_width) * color_height * 3 +
+                        static_cast<size_t>(depth_width) * depth_height * 2 * 2;
+    m_writer = std::make_unique<NativeMkvWriter>(proxy_config, m_device_info, false, frame_size);
+    if (!m_writer->open(m_part_path))
+    {
+        std::cerr << "Unable to create proxy file: " << m_part_path << std::endl;
+        m_writer.reset();
+        return false;
+    }
+
+    uint64_t fps = 1000000 / m_period_usec;
+    bool ok = true;
+    if (m_config.color_resolution != K4A_COLOR_RESOLUTION_OFF)
+    {
+        k4a_record_video_settings_t settings = {static_cast<uint64_t>(color_width),
+                                                static_cast<uint64_t>(color_height), fps};
+        ok = ok && K4A_SUCCEEDED(m_writer->add_custom_video_track("PROXY_COLOR", "V_MJPEG", nullptr, 0, &settings));
+    }
+    if (m_config.depth_mode != K4A_DEPTH_MODE_OFF)
+    {
+        std::vector<uint8_t> codec_private = bitmap_info_header(depth_width, depth_height, 16, "b16g");
+        k4a_record_video_settings_t settings = {static_cast<uint64_t>(depth_width),
+                                                static_cast<uint64_t>(depth_height), fps};
+        if (m_config.depth_mode != K4A_DEPTH_MODE_PASSIVE_IR)
+        {
+            ok = ok && K4A_SUCCEEDED(m_writer->add_custom_video_track("PROXY_DEPTH", "V_MS/VFW/FOURCC",
+                                                                      codec_private.data(), codec_private.size(),
+                                                                      &settings));
+        }
+        ok = ok && K4A_SUCCEEDED(m_writer->add_custom_video_track("PROXY_IR", "V_MS/VFW/FOURCC", codec_private.data(),
+                                                                  codec_private.size(), &settings));
+    }
+    ok = ok && K4A_SUCCEEDED(m_writer->add_tag("ATLAS_PROXY_FPS", std::to_string(fps).c_str()));
+    ok = ok && K4A_SUCCEEDED(m_writer->add_tag("ATLAS_PROXY_COLOR_SCALE", std::to_string(m_color_scale).c_str()));
+    ok = ok && K4A_SUCCEEDED(m_writer->add_tag("ATLAS_PROXY_DEPTH_DECIMATION",
+                                               std::to_string(proxy_decimation).c_str()));
+    ok = ok && K4A_SUCCEEDED(m_writer->write_header());
+    if (!ok)
+    {
+        std::cerr << "Unable to write proxy header: " << m_part_path << std::endl;
+        m_writer->close();
+        m_writer.reset();
+        fs::remove(m_part_path);
+        return false;
+    }
+    return true;
+}
+
+void ProxyWriter::add_capture(k4a_capture_t capture)
+{
+    uint64_t timestamp = 0;
+    k4a_image_t images[] = {k4a_capture_get_color_image(capture),
+                            k4a_capture_get_depth_image(capture),
+                            k4a_capture_get_ir_image(capture)};
+    for (k4a_image_t image : images)
+    {
+        if (image != nullptr)
+        {
+            if (timestamp == 0)
+            {
+                timestamp = k4a_image_get_device_timestamp_usec(image);
+            }
+            k4a_image_release(image);
+        }
+    }
+    // a capture without images has nothing to scale and no time on the proxy grid
+    if (m_writer == nullptr || timestamp == 0 || timestamp < m_next_timestamp)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_frames.size() >= queue_limit)
+        {
+            // try again with the next capture
+            ++recording_stats.proxy_frames_skipped;
+            return;
+        }
+        auto frame = std::make_shared<Frame>();
+        k4a_capture_reference(capture);
+        frame->capture = capture;
+        frame->timestamp = timestamp;
+        m_frames.push_back(frame);
+        ++m_pending;
+    }
+    // stay on the fps grid even when a capture arrives late
+    m_next_timestamp = std::max(m_next_timestamp, timestamp - timestamp % m_period_usec) + m_period_usec;
+    m_work_cv.notify_one();
+}
+
+void ProxyWriter::run()
+{
+    while (true)
+    {
+        std::shared_ptr<Frame> frame;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_work_cv.wait(lock, [this]() { return m_pending > 0 || m_stopping; });
+            if (m_pending == 0)
+            {
+                return;
+            }
+            for (const auto &queued : m_frames)
+            {
+                if (!queued->started)
+                {
+                    frame = queued;
+                    break;
+                }
+            }
+            frame->started = true;
+            --m_pending;
+        }
+
+        process(*frame);
+        k4a_capture_release(frame->capture);
+        frame->capture = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            frame->finished = true;
+        }
+        write_finished();
+    }
+}
+
+void ProxyWriter::process(Frame &frame)
+{
+    k4a_image_t color = k4a_capture_get_color_image(frame.capture);
+    if (color != nullptr)
+    {
+        if (!encode_color(color, frame.color) && !m_color_error_reported.exchange(true))
+        {
+            std::cerr << "Unable to encode proxy color, frames without color follow." << std::endl;
+        }
+        k4a_image_release(color);
+    }
+    k4a_image_t depth = k4a_capture_get_depth_image(frame.capture);
+    if (depth != nullptr)
+    {
+        decimate_16(depth, true, frame.depth);
+        k4a_image_release(depth);
+    }
+    k4a_image_t ir = k4a_capture_get_ir_image(frame.capture);
+    if (ir != nullptr)
+    {
+        decimate_16(ir, false, frame.ir);
+        k4a_image_release(ir);
+    }
+}
+
+bool ProxyWriter::encode_color(k4a_image_t image, std::vector<uint8_t> &jpeg)
+{
+    std::vector<uint8_t> rgb;
+    int width, height;
+    switch (k4a_image_get_format(image))
+    {
+    case K4A_IMAGE_FORMAT_COLOR_MJPG:
+        if (!decode_jpeg_scaled(k4a_image_get_buffer(image), k4a_image_get_size(image), m_color_scale, rgb, width,
+                                height))
+        {
+            return false;
+        }
+        break;
+    case K4A_IMAGE_FORMAT_COLOR_NV12:
+    case K4A_IMAGE_FORMAT_COLOR_YUY2:
+    case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+        scale_color(image, m_color_scale, rgb, width, height);
+        break;
+    default:
+        return false;
+    }
+    return encode_jpeg(rgb, width, height, proxy_jpeg_quality, jpeg);
+}
+
+void ProxyWriter::write_finished()
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    while (true)
+    {
+        std::shared_ptr<Frame> frame;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_frames.empty() || !m_frames.front()->finished)
+            {
+                break;
+            }
+            frame = m_frames.front();
+            m_frames.pop_front();
+        }
+        if (!m_write_failed && !write_frame(*frame))
+        {
+            std::cerr << "Unable to write proxy frame to: " << m_part_path << std::endl;
+            m_write_failed = true;
+        }
+        m_done_cv.notify_all();
+    }
+}
+
+bool ProxyWriter::write_frame(Frame &frame)
+{
+    std::pair<const char *, std::vector<uint8_t> *> tracks[] = {{"PROXY_COLOR", &frame.color},
+                                                                {"PROXY_DEPTH", &frame.depth},
+                                                                {"PROXY_IR", &frame.ir}};
+    for (const auto &track : tracks)
+    {
+        if (!track.second->empty() &&
+            K4A_FAILED(m_writer->write_custom_track_data(track.first, frame.timestamp, track.second->data(),
+                                                         track.second->size())))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string ProxyWriter::finish(bool keep)
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done_cv.wait(lock, [this]() { return m_frames.empty(); });
+        m_stopping = true;
+    }
+    m_work_cv.notify_all();
+    for (auto &worker : m_workers)
+    {
+        worker.join();
+    }
+    m_workers.clear();
+
+    if (m_writer == nullptr)
+    {
+        return std::string();
+    }
+    bool ok = !m_write_failed && K4A_SUCCEEDED(m_writer->flush());
+    ok = K4A_SUCCEEDED(m_writer->close()) && ok;
+    m_writer.reset();
+
+    std::error_code error;
+    if (ok && keep)
+    {
+        fs::rename(m_part_path, m_path, error);
+        if (!error)
+        {
+            return m_path;
+        }
+        std::cerr << "Unable to rename " << m_part_path << ": " << error.message() << std::endl;
+    }
+    fs::remove(m_part_path, error);
+    return std::string();
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <k4a/k4a.h>
+
+#include "mkv_writer.h"
+
+// Suffix of the proxy companion file, out-000001.mkv gets out-000001.proxy.mkv.
+static const char *const proxy_file_suffix = ".proxy.mkv";
+// depth and IR are decimated by this factor in both directions
+static const int proxy_decimation = 4;
+
+// Writes a low resolution copy of a block for browsing and scrubbing: fps frames per second with color as
+// small JPEG frames (MJPG frames are decoded with libjpeg DCT scaling, so they are never decoded at full
+// size) and depth and IR decimated by proxy_decimation. The copy is a native Matroska file with the
+// PROXY_COLOR (V_MJPEG), PROXY_DEPTH and PROXY_IR (b16g) tracks and the calibration of the block.
+// The capture thread only takes a reference on selected captures, worker threads scale and encode them
+// and the worker that completes the oldest pending frame writes all finished frames in order. Captures
+// are skipped (counted in recording_stats.proxy_frames_skipped) when the workers fall behind.
+class ProxyWriter
+{
+public:
+    static const unsigned worker_count = 2;
+    static const size_t queue_limit = 8;
+
+    ProxyWriter(const k4a_device_configuration_t &config, const device_info_t &device_info, uint32_t fps);
+    ~ProxyWriter();
+    ProxyWriter(const ProxyWriter &) = delete;
+    ProxyWriter &operator=(const ProxyWriter &) = delete;
+
+    // Open the companion file for the block that will be finalized as block_path.
+    bool open(const std::string &block_path);
+
+    void add_capture(k4a_capture_t capture);
+
+    // Wait for queued frames, close the file and move it next to the finalized block.
+    // With keep unset the proxy is deleted. Returns the proxy path, empty if there is none.
+    std::string finish(bool keep);
+
+private:
+    struct Frame
+    {
+        k4a_capture_t capture = nullptr;
+        bool started = false;
+        bool finished = false;
+        // all proxy tracks of a frame share the timestamp of its first image
+        uint64_t timestamp = 0;
+        std::vector<uint8_t> color;
+        std::vector<uint8_t> depth;
+        std::vector<uint8_t> ir;
+    };
+
+    void run();
+    void process(Frame &frame);
+    bool encode_color(k4a_image_t image, std::vector<uint8_t> &jpeg);
+    void write_finished();
+    bool write_frame(Frame &frame);
+
+    k4a_device_configuration_t m_config;
+    const device_info_t &m_device_info;
+    uint64_t m_period_usec;
+    uint64_t m_next_timestamp = 0;
+
+    int m_color_width = 0;
+    int m_color_height = 0;
+    // color downscale factor, 1/2/4/8 so MJPG can be scaled while decoding
+    int m_color_scale = 1;
+    int m_depth_width = 0;
+    int m_depth_height = 0;
+
+    std::string m_path;
+    std::string m_part_path;
+    std::unique_ptr<NativeMkvWriter> m_writer;
+    bool m_write_failed = false;
+    std::atomic_bool m_color_error_reported{false};
+
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_done_cv;
+    std::deque<std::shared_ptr<Frame>> m_frames;
+    size_t m_pending = 0;
+    bool m_stopping = false;
+    // serializes writes, held by the worker that writes finished frames
+    std::mutex m_write_mutex;
+};
@@ -2,7 +2,21 @@
 // Licensed under the MIT License.
 
 #include "recorder.h"
+#include "block_writer.h"
+#include "block_summary.h"
+#include "depth_registration.h"
+#include "device_probe.h"
+#include "host_clock.h"
+#include "checksum.h"
+#include "migrator.h"
+#include "proxy_writer.h"
+#include "stream_filter.h"
+#include "trace.h"
+#include "frame_source.h"
+#include "fault_injection.h"
 #include <ctime>
+#include <cerrno>
+#include <cstring>
 #include <chrono>
 #include <atomic>
 #include <iostream>
@@ -12,6 +26,8 @@
 #include <assert.h>
 #include <time.h>
 #include <filesystem>
+#include <memory>
+#include <vector>
 
 #include <fmt/core.h>
 
@@ -35,14 +51,174 @@ namespace fs = std::filesystem;
 
 std::atomic_bool exiting(false);
 std::thread backup_thread;
+recording_stats_t recording_stats;
 
-int do_recording(uint8_t device_index,
-                 std::string base_filename,
-                 int max_block_length,
-                 k4a_device_configuration_t *device_config,
-                 bool record_imu,
-                 int32_t absoluteExposureValue,
-                 int32_t gain)
+// Waits for the finalizers and stops the migrator when the block loop is left through an error return, the
+// finalizers use locals of do_recording and the migrator. The regular shutdown does both itself.
+struct finalizer_scope_t
+{
+    std::thread &last_finalizer;
+    BlockMigrator *migrator;
+    milliseconds drain_timeout;
+
+    ~finalizer_scope_t()
+    {
+        if (backup_thread.joinable())
+        {
+            backup_thread.join();
+        }
+        if (last_finalizer.joinable())
+        {
+            last_finalizer.join();
+        }
+        if (migrator != nullptr)
+        {
+            migrator->stop(steady_clock::now() + drain_timeout);
+        }
+    }
+};
+
+// CLOCK_MONOTONIC (steady_clock) time of the first stop request in ns, 0 while none was made
+static std::atomic<int64_t> stop_request_nsec{0};
+static_assert(std::atomic<int64_t>::is_always_lock_free, "request_stop() must be async-signal-safe");
+
+void request_stop()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t expected = 0;
+    stop_request_nsec.compare_exchange_strong(expected, int64_t(now.tv_sec) * 1000000000 + now.tv_nsec);
+    exiting = true;
+}
+
+static uint64_t capture_device_timestamp_usec(k4a_capture_t capture)
+{
+    uint64_t timestamp = 0;
+    k4a_image_t images[] = {k4a_capture_get_color_image(capture),
+                            k4a_capture_get_depth_image(capture),
+                            k4a_capture_get_ir_image(capture)};
+    for (k4a_image_t image : images)
+    {
+        if (image != nullptr)
+        {
+            if (timestamp == 0)
+            {
+                timestamp = k4a_image_get_device_timestamp_usec(image);
+            }
+            k4a_image_release(image);
+        }
+    }
+    return timestamp;
+}
+
+// Time the capture waited between the host receiving its first image and now, 0 if the source does not
+// stamp arrival. The SDK stamps arrival with CLOCK_MONOTONIC, which is steady_clock here.
+static int64_t capture_queue_delay_usec(k4a_capture_t capture)
+{
+    uint64_t arrival_nsec = 0;
+    k4a_image_t images[] = {k4a_capture_get_color_image(capture),
+                            k4a_capture_get_depth_image(capture),
+                            k4a_capture_get_ir_image(capture)};
+    for (k4a_image_t image : images)
+    {
+        if (image != nullptr)
+        {
+            if (arrival_nsec == 0)
+            {
+                arrival_nsec = k4a_image_get_system_timestamp_nsec(image);
+            }
+            k4a_image_release(image);
+        }
+    }
+    if (arrival_nsec == 0)
+    {
+        return 0;
+    }
+    int64_t now_nsec = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+    return (now_nsec - static_cast<int64_t>(arrival_nsec)) / 1000;
+}
+
+static size_t capture_size_bytes(k4a_capture_t capture)
+{
+    size_t size = 0;
+    k4a_image_t images[] = {k4a_capture_get_color_image(capture),
+                            k4a_capture_get_depth_image(capture),
+                            k4a_capture_get_ir_image(capture)};
+    for (k4a_image_t image : images)
+    {
+        if (image != nullptr)
+        {
+            size += k4a_image_get_size(image);
+            k4a_image_release(image);
+        }
+    }
+    return size;
+}
+
+// Print the outcome of a --simulate run and check the recorder invariants.
+static bool check_simulation(const SyntheticFrameSource &source,
+                             const recording_options_t &options,
+                             uint32_t camera_fps,
+                             steady_clock::duration shutdown_time,
+                             const fs::path &dir)
+{
+    auto shutdown_ms = duration_cast<milliseconds>(shutdown_time).count();
+    size_t temp_files = 0;
+    for (const auto &entry : fs::directory_iterator(dir.empty() ? fs::path(".") : dir))
+    {
+        if (entry.path().filename().string().rfind("_temp_", 0) == 0)
+        {
+            ++temp_files;
+        }
+    }
+
+    std::cout << "Simulation report" << std::endl;
+    std::cout << "  frames produced: " << source.frames_produced() << ", dropped by device buffer: "
+              << source.frames_dropped() << ", delivered: " << source.frames_delivered() << std::endl;
+    std::cout << "  frames written: " << recording_stats.frames_written
+              << ", failed writes: " << recording_stats.frames_failed
+              << ", not summarized: " << recording_stats.frames_not_summarized
+              << ", not registered: " << recording_stats.frames_not_registered
+              << ", proxy skipped: " << recording_stats.proxy_frames_skipped << std::endl;
+    std::cout << "  image pool exhausted: " << recording_stats.image_pool_exhausted << " times" << std::endl;
+    std::cout << "  blocks created: " << recording_stats.blocks_created << ", finalized: "
+              << recording_stats.blocks_finalized << ", kept as temp file: " << recording_stats.blocks_kept_temp
+              << " (" << temp_files << " on disk)" << std::endl;
+    std::cout << "  shutdown time: " << shutdown_ms << "ms" << std::endl;
+
+    bool ok = true;
+    // a recorder that keeps up only loses frames to stalls longer than the device buffer. At block rotation
+    // the capture thread waits for the previous finalizer, a flush that outlasts a block stalls capture.
+    uint32_t write_stall_ms = fault_max_write_stall_ms();
+    if (fault_flush_delay_ms() >= uint64_t(options.max_block_length) * 1000 / camera_fps)
+    {
+        write_stall_ms = UINT32_MAX;
+    }
+    if (source.frames_dropped() > 0 && source.within_buffer_budget(write_stall_ms))
+    {
+        std::cerr << "Invariant violated: frames were dropped although every stall fit into the device buffer."
+                  << std::endl;
+        ok = false;
+    }
+    if (recording_stats.blocks_created != recording_stats.blocks_finalized + recording_stats.blocks_kept_temp ||
+        temp_files != recording_stats.blocks_kept_temp)
+    {
+        std::cerr << "Invariant violated: not every block was finalized or kept recoverable." << std::endl;
+        ok = false;
+    }
+    if (shutdown_ms > source.max_shutdown_ms())
+    {
+        std::cerr << "Invariant violated: shutdown took longer than " << source.max_shutdown_ms() << "ms." << std::endl;
+        ok = false;
+    }
+    return ok;
+}
+
+static int start_device(uint8_t device_index,
+                        k4a_device_configuration_t *device_config,
+                        const recording_options_t &options,
+                        k4a_device_t *device_out,
+                        device_info_t *device_info)
 {
     const uint32_t installed_devices = k4a_device_get_installed_count();
     if (device_index >= installed_devices)
@@ -55,17 +231,13 @@ int do_recording(uint8_t device_index,
     if (K4A_FAILED(k4a_device_open(device_index, &device)))
     {
         std::cerr << "Runtime error: k4a_device_open() failed " << std::endl;
+        return 1;
     }
 
-    char serial_number_buffer[256];
-    size_t serial_number_buffer_size = sizeof(serial_number_buffer);
-    CHECK(k4a_device_get_serialnum(device, serial_number_buffer, &serial_number_buffer_size), device);
-
-    std::cout << "Device serial number: " << serial_number_buffer << std::endl;
-
-    k4a_hardware_version_t version_info;
-    CHECK(k4a_device_get_version(device, &version_info), device);
+    CHECK(query_device_info(device, device_info), device);
+    const k4a_hardware_version_t &version_info = device_info->version;
 
+    std::cout << "Device serial number: " << device_info->serial_number << std::endl;
     std::cout << "Device version: " << (version_info.firmware_build == K4A_FIRMWARE_BUILD_RELEASE ? "Rel" : "Dbg")
               << "; C: " << version_info.rgb.major << "." << version_info.rgb.minor << "." << version_info.rgb.iteration
               << "; D: " << version_info.depth.major << "." << version_info.depth.minor << "."
@@ -73,26 +245,17 @@ int do_recording(uint8_t device_index,
               << version_info.depth_sensor.minor << "]"
               << "; A: " << version_info.audio.major << "." << version_info.audio.minor << "."
               << version_info.audio.iteration << std::endl;
-
-    uint32_t camera_fps = k4a_convert_fps_to_uint(device_config->camera_fps);
-
-    // store recording metadata
-    fs::path base_path(base_filename);
-    fs::path dir = base_path.parent_path();
-
-    if (camera_fps <= 0 || (device_config->color_resolution == K4A_COLOR_RESOLUTION_OFF &&
-                            device_config->depth_mode == K4A_DEPTH_MODE_OFF))
+    if (device_info->raw_calibration.empty())
     {
-        std::cerr << "Either the color or depth modes must be enabled to record." << std::endl;
-        return 1;
+        std::cerr << "Runtime error: k4a_device_get_raw_calibration() failed " << std::endl;
     }
 
-    if (absoluteExposureValue != defaultExposureAuto)
+    if (options.absoluteExposureValue != defaultExposureAuto)
     {
         if (K4A_FAILED(k4a_device_set_color_control(device,
                                                     K4A_COLOR_CONTROL_EXPOSURE_TIME_ABSOLUTE,
                                                     K4A_COLOR_CONTROL_MODE_MANUAL,
-                                                    absoluteExposureValue)))
+                                                    options.absoluteExposureValue)))
         {
             std::cerr << "Runtime error: k4a_device_set_color_control() for manual exposure failed " << std::endl;
         }
@@ -108,23 +271,126 @@ int do_recording(uint8_t device_index,
         }
     }
 
-    if (gain != defaultGainAuto)
+    if (options.gain != defaultGainAuto)
     {
         if (K4A_FAILED(
-                k4a_device_set_color_control(device, K4A_COLOR_CONTROL_GAIN, K4A_COLOR_CONTROL_MODE_MANUAL, gain)))
+                k4a_device_set_color_control(device, K4A_COLOR_CONTROL_GAIN, K4A_COLOR_CONTROL_MODE_MANUAL, options.gain)))
         {
             std::cerr << "Runtime error: k4a_device_set_color_control() for manual gain failed " << std::endl;
         }
     }
 
     CHECK(k4a_device_start_cameras(device, device_config), device);
-    if (record_imu)
+    if (options.record_imu)
     {
         CHECK(k4a_device_start_imu(device), device);
     }
 
     std::cout << "Device started" << std::endl;
 
+    *device_out = device;
+    return 0;
+}
+
+int do_recording(uint8_t device_index,
+                 std::string base_filename,
+                 k4a_device_configuration_t *device_config,
+                 const recording_options_t &options)
+{
+    uint32_t camera_fps = k4a_convert_fps_to_uint(device_config->camera_fps);
+
+    if (!options.trace_file.empty())
+    {
+        trace_enable();
+    }
+
+    // store recording metadata
+    fs::path base_path(base_filename);
+    fs::path dir = base_path.parent_path();
+
+    if (camera_fps <= 0 || (device_config->color_resolution == K4A_COLOR_RESOLUTION_OFF &&
+                            device_config->depth_mode == K4A_DEPTH_MODE_OFF))
+    {
+        std::cerr << "Either the color or depth modes must be enabled to record." << std::endl;
+        return 1;
+    }
+
+    k4a_device_t device = nullptr;
+    device_info_t device_info;
+    std::unique_ptr<FrameSource> source;
+    SyntheticFrameSource *synthetic_source = nullptr;
+    if (options.simulate.empty())
+    {
+        if (start_device(device_index, device_config, options, &device, &device_info) != 0)
+        {
+            return 1;
+        }
+        source = std::make_unique<DeviceFrameSource>(device, device_info.raw_calibration);
+    }
+    else
+    {
+        try
+        {
+            auto synthetic = std::make_unique<SyntheticFrameSource>(options.simulate, *device_config, options.record_imu);
+            synthetic_source = synthetic.get();
+            source = std::move(synthetic);
+        }
+        catch (const std::runtime_error &e)
+        {
+            std::cerr << "Invalid simulation settings: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Simulating device: " << options.simulate << std::endl;
+    }
+
+    std::unique_ptr<DepthRegistration> registration;
+    if (options.registered_depth)
+    {
+        k4a_calibration_t calibration;
+        if (device_config->color_resolution == K4A_COLOR_RESOLUTION_OFF ||
+            device_config->depth_mode == K4A_DEPTH_MODE_OFF || device_config->depth_mode == K4A_DEPTH_MODE_PASSIVE_IR)
+        {
+            std::cerr << "Registered depth needs the color camera and an active depth mode." << std::endl;
+            if (device != nullptr)
+            {
+                k4a_device_close(device);
+            }
+            return 1;
+        }
+        if (K4A_FAILED(source->get_calibration(*device_config, &calibration)))
+        {
+            std::cerr << "Runtime error: unable to get the calibration for registered depth." << std::endl;
+            if (device != nullptr)
+            {
+                k4a_device_close(device);
+            }
+            return 1;
+        }
+        unsigned threads = std::max(1u, std::thread::hardware_concurrency() / 2);
+        registration = std::make_unique<DepthRegistration>(calibration, threads);
+        std::cout << "Registering depth to color on " << threads << " threads." << std::endl;
+    }
+
+    std::unique_ptr<StreamFilter> stream_filter;
+    try
+    {
+        auto filter = std::make_unique<StreamFilter>(*device_config, options);
+        if (filter->active())
+        {
+            stream_filter = std::move(filter);
+        }
+    }
+    catch (const std::runtime_error &e)
+    {
+        std::cerr << "Invalid stream decimation or ROI: " << e.what() << std::endl;
+        if (device != nullptr)
+        {
+            k4a_device_close(device);
+        }
+        return 1;
+    }
+
+
     // Wait for the first capture before starting recording.
     k4a_capture_t capture;
     seconds timeout_sec_for_first_capture(60);
@@ -138,7 +404,7 @@ int do_recording(uint8_t device_index,
     // Wait for the first capture in a loop so Ctrl-C will still exit.
     while (!exiting && (steady_clock::now() - first_capture_start) < timeout_sec_for_first_capture)
     {
-        result = k4a_device_get_capture(device, &capture, 100);
+        result = source->get_capture(&capture, 100);
         if (result == K4A_WAIT_RESULT_SUCCEEDED)
         {
             k4a_capture_release(capture);
@@ -154,7 +420,10 @@ int do_recording(uint8_t device_index,
     if (exiting)
     {
         // sighandler sets exiting flag.. we can flush the record here
-        k4a_device_close(device);
+        if (device != nullptr)
+        {
+            k4a_device_close(device);
+        }
         return 0;
     }
     else if (result == K4A_WAIT_RESULT_TIMEOUT)
@@ -167,87 +436,313 @@ int do_recording(uint8_t device_index,
     std::cout << "Press Ctrl-C to stop recording." << std::endl;
 
     size_t file_counter = 0;
-
-    auto current_recording = std::make_unique<k4a_record_t>();
-    auto next_recording = std::make_unique<k4a_record_t>();
+    int64_t frame_id = 0;
+    uint64_t last_device_timestamp = 0;
+    const uint64_t frame_period_usec = 1000000 / camera_fps;
+    // device to host clock fit, continues across blocks since the device clock does
+    HostClockModel host_clock;
+    uint64_t host_clock_device_usec = 0;
+    uint64_t next_host_clock_record = 0;
+    trace_set_thread_name("capture");
 
     std::atomic<bool> ext_flush_done{false};
+    std::thread last_finalizer;
+    int exit_code = 0;
+
+    std::unique_ptr<BlockMigrator> migrator;
+    if (!options.migrate_dir.empty())
+    {
+        migrator = std::make_unique<BlockMigrator>(options.migrate_dir, options.migrate_bandwidth);
+        migrator->start();
+    }
+    finalizer_scope_t finalizer_scope{last_finalizer, migrator.get(), milliseconds(options.shutdown_timeout_ms)};
+
+    // write one capture and release it, a failed write stops the recording after this block
+    auto write_capture = [&](BlockWriter &recording, BlockSummarizer *summary, ProxyWriter *proxy,
+                             k4a_capture_t capture, uint64_t wait_start) {
+        ++frame_id;
+        ++recording_stats.frames_received;
+        if (options.record_host_clock)
+        {
+            host_clock_device_usec = host_clock.add_capture(capture);
+        }
+        uint64_t device_timestamp = capture_device_timestamp_usec(capture);
+        // a gap of more than 1.5 frame periods in device time means the sensor produced frames we never saw
+        bool frame_gap = last_device_timestamp != 0 &&
+                         device_timestamp > last_device_timestamp + frame_period_usec * 3 / 2;
+        if (trace_enabled())
+        {
+            trace_complete("get_capture", wait_start, trace_now_usec(), "frame", frame_id, "device_usec",
+                           static_cast<int64_t>(device_timestamp));
+            if (frame_gap)
+            {
+                trace_instant("frame_gap", "frame", frame_id, "missing",
+                              static_cast<int64_t>((device_timestamp - last_device_timestamp) / frame_period_usec - 1));
+            }
+        }
+        if (device_timestamp != 0)
+        {
+            last_device_timestamp = device_timestamp;
+        }
+        // lost frames or a capture that waited behind another one mean the capture queue is filling
+        if (migrator &&
+            (frame_gap || capture_queue_delay_usec(capture) > 2 * static_cast<int64_t>(frame_period_usec)))
+        {
+            migrator->report_capture_backlog();
+        }
+
+        k4a_result_t write_result = K4A_RESULT_FAILED;
+        if (fault_before_write(capture_size_bytes(capture)))
+        {
+            TraceScope trace_write("write_capture", "frame", frame_id);
+            write_result = stream_filter ? stream_filter->write_capture(recording, capture)
+                                         : recording.write_capture(capture);
+        }
+        if (K4A_SUCCEEDED(write_result) && summary != nullptr)
+        {
+            summary->add_capture(capture);
+        }
+        if (K4A_SUCCEEDED(write_result) && proxy != nullptr)
+        {
+            proxy->add_capture(capture);
+        }
+        if (K4A_SUCCEEDED(write_result) && registration && !registration->submit(capture))
+        {
+            // mark the frame so readers can tell a skipped registration from a missing depth frame
+            ++recording_stats.frames_not_registered;
+            k4a_image_t depth = k4a_capture_get_depth_image(capture);
+            uint8_t skipped[] = "skipped";
+            recording.write_custom_track_data(registered_depth_skipped_track_name,
+                                              k4a_image_get_device_timestamp_usec(depth), skipped,
+                                              sizeof(skipped) - 1);
+            k4a_image_release(depth);
+        }
+        if (K4A_SUCCEEDED(write_result) && options.record_host_clock && host_clock.valid() &&
+            host_clock_device_usec >= next_host_clock_record)
+        {
+            // one record per second, readers use the last one before the time they look up
+            std::string record = host_clock.record(host_clock_device_usec);
+            recording.write_custom_track_data(host_clock_track_name, host_clock_device_usec,
+                                              reinterpret_cast<uint8_t *>(record.data()), record.size());
+            next_host_clock_record = host_clock_device_usec + 1000000;
+        }
+        k4a_capture_release(capture);
+        if (K4A_FAILED(write_result))
+        {
+            // keep what is already in the block, it is finalized like any other
+            std::cerr << "Runtime error: write_capture() failed: " << std::strerror(errno) << std::endl;
+            ++recording_stats.frames_failed;
+            exit_code = 1;
+            exiting = true;
+            return false;
+        }
+        ++recording_stats.frames_written;
+        return true;
+    };
+
+    // write all IMU samples that are currently queued
+    auto write_imu_samples = [&](BlockWriter &recording, BlockSummarizer *summary) {
+        k4a_wait_result_t imu_result;
+        while (true)
+        {
+            k4a_imu_sample_t sample;
+            imu_result = source->get_imu_sample(&sample, 0);
+            if (imu_result == K4A_WAIT_RESULT_TIMEOUT)
+            {
+                break;
+            }
+            else if (imu_result != K4A_WAIT_RESULT_SUCCEEDED)
+            {
+                std::cerr << "Runtime error: k4a_imu_get_sample() returned " << imu_result << std::endl;
+                break;
+            }
+            k4a_result_t write_result = recording.write_imu_sample(sample);
+            if (K4A_FAILED(write_result))
+            {
+                std::cerr << "Runtime error: write_imu_sample() returned " << write_result << std::endl;
+                break;
+            }
+            if (summary != nullptr)
+            {
+                summary->add_imu_sample(sample);
+            }
+        }
+        return imu_result;
+    };
+
+    // write registered depth frames that are done, with wait also those still being computed
+    auto write_registered_depth = [&](BlockWriter &recording, bool wait) {
+        std::vector<k4a_image_t> done;
+        registration->collect(done, wait);
+        for (k4a_image_t image : done)
+        {
+            TraceScope trace_write("write_registered_depth");
+            k4a_result_t write_result =
+                recording.write_custom_track_data(registered_depth_track_name,
+                                                  k4a_image_get_device_timestamp_usec(image),
+                                                  k4a_image_get_buffer(image), k4a_image_get_size(image));
+            if (K4A_FAILED(write_result))
+            {
+                std::cerr << "Runtime error: writing registered depth returned " << write_result << std::endl;
+            }
+            k4a_image_release(image);
+        }
+    };
 
     while(!exiting) {
 
         std::string final_filename = next_record_name(base_filename, file_counter);
         // write file to temp file until is has been closed.
         std::string recording_filename = (dir / ("_temp_" + std::to_string(file_counter) + ".tmp")).string();
-        if (K4A_FAILED(k4a_record_create(recording_filename.c_str(), device, *device_config, current_recording.get())))
+        std::unique_ptr<BlockWriter> recording =
+            create_block_writer(recording_filename, device, *device_config, options, device_info);
+        if (!recording)
         {
             std::cerr << "Unable to create recording file: " << recording_filename << std::endl;
             return 1;
         }
 
+        std::unique_ptr<BlockSummarizer> summary;
+        if (options.record_summaries)
+        {
+            summary = std::make_unique<BlockSummarizer>();
+        }
+        std::unique_ptr<ProxyWriter> proxy;
+        if (options.proxy_fps > 0)
+        {
+            // the block is recorded without a proxy if its companion file can't be created
+            proxy = std::make_unique<ProxyWriter>(*device_config, device_info, options.proxy_fps);
+            if (!proxy->open(final_filename))
+            {
+                proxy.reset();
+            }
+        }
+
         std::cout << "Created file: " << recording_filename << std::endl;
+        ++recording_stats.blocks_created;
         try {
             int frame_cnt = 0;
-            if (record_imu)
+            if (options.record_imu)
             {
-                CHECK(k4a_record_add_imu_track(*current_recording), device);
+                CHECK(recording->add_imu_track(), device);
             }
-            CHECK(k4a_record_write_header(*current_recording), device);
+            if (registration)
+            {
+                std::vector<uint8_t> codec_private =
+                    bitmap_info_header(registration->width(), registration->height(), 16, "b16g");
+                k4a_record_video_settings_t video_settings = {static_cast<uint64_t>(registration->width()),
+                                                              static_cast<uint64_t>(registration->height()),
+                                                              camera_fps};
+                k4a_record_subtitle_settings_t subtitle_settings = {false};
+                CHECK(recording->add_custom_video_track(registered_depth_track_name, "V_MS/VFW/FOURCC",
+                                                        codec_private.data(), codec_private.size(),
+                                                        &video_settings),
+                      device);
+                CHECK(recording->add_custom_subtitle_track(registered_depth_skipped_track_name, "S_TEXT/UTF8",
+                                                           nullptr, 0, &subtitle_settings),
+                      device);
+            }
+            if (stream_filter)
+            {
+                CHECK(stream_filter->add_tracks(*recording), device);
+            }
+            if (options.record_host_clock)
+            {
+                k4a_record_subtitle_settings_t subtitle_settings = {false};
+                CHECK(recording->add_custom_subtitle_track(host_clock_track_name, "S_TEXT/UTF8", nullptr, 0,
+                                                           &subtitle_settings),
+                      device);
+                // start every block with a record so it can be aligned on its own
+                next_host_clock_record = 0;
+            }
+            CHECK(recording->write_header(), device);
 
             int32_t timeout_ms = 1000 / camera_fps;
             do
             {
                 ++frame_cnt;
-                result = k4a_device_get_capture(device, &capture, timeout_ms);
+                uint64_t wait_start = trace_enabled() ? trace_now_usec() : 0;
+                result = source->get_capture(&capture, timeout_ms);
                 if (result == K4A_WAIT_RESULT_TIMEOUT)
                 {
                     continue;
                 }
                 else if (result != K4A_WAIT_RESULT_SUCCEEDED)
                 {
-                    std::cerr << "Runtime error: k4a_device_get_capture() returned " << result << std::endl;
+                    if (!source->finished())
+                    {
+                        std::cerr << "Runtime error: k4a_device_get_capture() returned " << result << std::endl;
+                        exit_code = 1;
+                    }
+                    // without a source there is nothing left to record, finalize this block and stop
+                    exiting = true;
+                    break;
+                }
+
+                if (!write_capture(*recording, summary.get(), proxy.get(), capture, wait_start))
+                {
                     break;
                 }
-                
-                CHECK(k4a_record_write_capture(*current_recording, capture), device);
-                k4a_capture_release(capture);
 
                 if (backup_thread.joinable() && ext_flush_done) {
                     backup_thread.join();
                     ext_flush_done = false;
                 }
 
-                if (record_imu)
+                if (options.record_imu)
                 {
-                    do
-                    {
-                        k4a_imu_sample_t sample;
-                        result = k4a_device_get_imu_sample(device, &sample, 0);
-                        if (result == K4A_WAIT_RESULT_TIMEOUT)
-                        {
-                            break;
-                        }
-                        else if (result != K4A_WAIT_RESULT_SUCCEEDED)
-                        {
-                            std::cerr << "Runtime error: k4a_imu_get_sample() returned " << result << std::endl;
-                            break;
-                        }
-                        k4a_result_t write_result = k4a_record_write_imu_sample(*current_recording, sample);
-                        if (K4A_FAILED(write_result))
-                        {
-                            std::cerr << "Runtime error: k4a_record_write_imu_sample() returned " << write_result << std::endl;
-                            break;
-                        }
-                    } while (!exiting && result != K4A_WAIT_RESULT_FAILED &&
-                             frame_cnt < max_block_length);
+                    result = write_imu_samples(*recording, summary.get());
+                }
+                if (registration)
+                {
+                    write_registered_depth(*recording, false);
                 }
                 if (frame_cnt % 300 == 0) {
-                    std::cout << "Capturing.. frame count: " << frame_cnt << " / " << max_block_length << std::endl;
+                    std::cout << "Capturing.. frame count: " << frame_cnt << " / " << options.max_block_length << std::endl;
                 }
-            } while (!exiting && result != K4A_WAIT_RESULT_FAILED && frame_cnt < max_block_length);
+            } while (!exiting && result != K4A_WAIT_RESULT_FAILED && frame_cnt < options.max_block_length);
+
+            if (exiting && exit_code == 0)
+            {
+                // the SDK still holds captures that arrived before the stop request, write them into
+                // this block instead of dropping them. Keep half of the shutdown budget for finalizing.
+                steady_clock::time_point drain_deadline = steady_clock::now() +
+                                                          milliseconds(options.shutdown_timeout_ms / 2);
+                size_t drained = 0;
+                while (steady_clock::now() < drain_deadline &&
+                       source->get_capture(&capture, 0) == K4A_WAIT_RESULT_SUCCEEDED)
+                {
+                    if (!write_capture(*recording, summary.get(), proxy.get(), capture, trace_enabled() ? trace_now_usec() : 0))
+                    {
+                        break;
+                    }
+                    ++drained;
+                }
+                if (options.record_imu)
+                {
+                    write_imu_samples(*recording, summary.get());
+                }
+                if (drained > 0)
+                {
+                    std::cout << "Drained " << drained << " queued captures." << std::endl;
+                }
+            }
+            if (registration)
+            {
+                // registered frames belong to this block, waits at most for the frames in flight
+                write_registered_depth(*recording, true);
+            }
+            if (options.record_host_clock && host_clock.valid() && host_clock_device_usec > 0)
+            {
+                // the model after the last capture of the block, the best fit for all of it
+                std::string record = host_clock.record(host_clock_device_usec);
+                recording->write_custom_track_data(host_clock_track_name, host_clock_device_usec,
+                                                   reinterpret_cast<uint8_t *>(record.data()), record.size());
+            }
         } catch (...) {
             std::cout << "error during capture.. trying to clean up." << std::endl;
-            k4a_record_flush(*current_recording);
-            k4a_record_close(*current_recording);
+            recording->flush();
+            recording->close();
 
             if (backup_thread.joinable()) {
                 backup_thread.join();
@@ -255,22 +750,114 @@ int do_recording(uint8_t device_index,
             // leave loop and close device;
             break;
         }
-        if (backup_thread.joinable()) {
+        // on shutdown the previous block may still be finalizing, finalize both in parallel
+        if (backup_thread.joinable() && !exiting) {
             backup_thread.join();
         }
 
-        std::swap(current_recording, next_recording);
-
-        backup_thread = std::thread([&ext_flush_done](k4a_record_t record, k4a_device_t device,
-            std::string tmp, std::string final_name) {
+        std::thread finalizer([&ext_flush_done, &options, migrator = migrator.get()](std::unique_ptr<BlockWriter> record,
+            std::unique_ptr<BlockSummarizer> summary, std::unique_ptr<ProxyWriter> proxy,
+            std::string tmp, std::string final_name, int64_t block) {
+                trace_set_thread_name("finalize");
+                if (migrator) {
+                    migrator->begin_capture_io();
+                }
+                // whatever made it to disk stays in the temp file for manual recovery
+                auto keep_temp = [&]() {
+                    ++recording_stats.blocks_kept_temp;
+                    if (summary) {
+                        summary->finish(std::string());
+                    }
+                    if (proxy) {
+                        proxy->finish(false);
+                    }
+                    if (migrator) {
+                        migrator->end_capture_io();
+                    }
+                    ext_flush_done = true;
+                    return 1;
+                };
                 std::cout << "Saving recording: " << final_name << std::endl;
-                CHECK(k4a_record_flush(record), device)
-                k4a_record_close(record);
+                k4a_result_t flush_result;
+                {
+                    TraceScope trace_flush("block_flush", "block", block);
+                    fault_before_flush();
+                    flush_result = record->flush();
+                }
+                if (K4A_FAILED(flush_result)) {
+                    std::cerr << "Runtime error: flushing " << tmp << " failed, block is kept as temp file." << std::endl;
+                    record->close();
+                    return keep_temp();
+                }
+                k4a_result_t close_result;
+                {
+                    TraceScope trace_close("block_close", "block", block);
+                    close_result = record->close();
+                }
+                if (K4A_FAILED(close_result)) {
+                    std::cerr << "Runtime error: closing " << tmp << " failed, block is kept as temp file." << std::endl;
+                    return keep_temp();
+                }
+                // hash right after close while the block is still in the page cache, this avoids a separate
+                // read pass over the recording later on. --direct-io blocks never enter the page cache and
+                // pay a full read of the block from disk here.
+                uint64_t digest = 0;
+                bool hashed = false;
+                if (options.record_checksums) {
+                    TraceScope trace_hash("block_checksum", "block", block);
+                    hashed = hash_file(tmp, digest);
+                    if (!hashed) {
+                        std::cerr << "Unable to compute checksum of: " << tmp << std::endl;
+                    }
+                }
                 std::cout << "Renaming: " << tmp << " to " << final_name << std::endl;
-                std::rename(tmp.c_str(), final_name.c_str());
+                int rename_result;
+                {
+                    TraceScope trace_rename("block_rename", "block", block);
+                    rename_result = fault_rename(tmp.c_str(), final_name.c_str());
+                }
+                if (rename_result != 0) {
+                    // the closed temp file is a complete recording, leave it for manual recovery
+                    std::cerr << "Unable to rename " << tmp << ": " << std::strerror(errno)
+                              << ", block is kept as temp file." << std::endl;
+                    return keep_temp();
+                }
+                ++recording_stats.blocks_finalized;
+                if (hashed) {
+                    fs::path final_path(final_name);
+                    if (!append_manifest_entry(final_path.parent_path().string(), final_path.filename().string(), digest)) {
+                        std::cerr << "Unable to write checksum manifest for: " << final_name << std::endl;
+                    }
+                }
+                bool summarized = false;
+                std::string summary_name = final_name + block_summary_extension;
+                if (summary) {
+                    TraceScope trace_summary("block_summary", "block", block);
+                    summarized = summary->finish(summary_name);
+                }
+                std::string proxy_name;
+                if (proxy) {
+                    TraceScope trace_proxy("block_proxy", "block", block);
+                    proxy_name = proxy->finish(true);
+                }
+                if (migrator) {
+                    migrator->end_capture_io();
+                    migrator->enqueue(final_name, hashed, digest);
+                    if (summarized) {
+                        migrator->enqueue(summary_name, false, 0);
+                    }
+                    if (!proxy_name.empty()) {
+                        migrator->enqueue(proxy_name, false, 0);
+                    }
+                }
                 ext_flush_done = true;
                 return 0;
-        }, *next_recording, device, recording_filename, final_filename);
+        }, std::move(recording), std::move(summary), std::move(proxy), recording_filename, final_filename, static_cast<int64_t>(file_counter));
+        if (backup_thread.joinable()) {
+            last_finalizer = std::move(finalizer);
+        } else {
+            backup_thread = std::move(finalizer);
+        }
 
         ++file_counter;
     }
@@ -280,19 +867,81 @@ int do_recording(uint8_t device_index,
         exiting = true;
         std::cout << "Stopping recording..." << std::endl;
     }
+    // the shutdown budget starts with the stop request, or here if the recording ended on its own
+    steady_clock::time_point shutdown_start = steady_clock::now();
+    if (stop_request_nsec != 0)
+    {
+        shutdown_start = steady_clock::time_point(duration_cast<steady_clock::duration>(nanoseconds(stop_request_nsec)));
+    }
     if (backup_thread.joinable()) {
         backup_thread.join();
     }
+    if (last_finalizer.joinable()) {
+        last_finalizer.join();
+    }
+    if (migrator) {
+        // the last blocks were only just enqueued, migrate them within what is left of the shutdown budget
+        migrator->stop(shutdown_start + milliseconds(options.shutdown_timeout_ms));
+    }
+    if (!options.trace_file.empty()) {
+        trace_export(options.trace_file);
+    }
+
+    if (device != nullptr)
+    {
+        if (options.record_imu) { k4a_device_stop_imu(device);
+        }
+        k4a_device_stop_cameras(device);
+    }
 
-    if (record_imu) { k4a_device_stop_imu(device);
+    std::cout << "Done: wrote " << recording_stats.frames_written << " frames, finalized "
+              << recording_stats.blocks_finalized << " of " << recording_stats.blocks_created << " blocks in "
+              << duration_cast<milliseconds>(steady_clock::now() - shutdown_start).count() << "ms after stop."
+              << std::endl;
+    if (recording_stats.frames_not_summarized > 0)
+    {
+        std::cout << recording_stats.frames_not_summarized
+                  << " frames were skipped in the block summaries because the summarizer fell behind." << std::endl;
+    }
+    if (recording_stats.imu_samples_not_summarized > 0)
+    {
+        std::cout << recording_stats.imu_samples_not_summarized
+                  << " IMU samples were skipped in the block summaries because the summarizer fell behind." << std::endl;
+    }
+    if (recording_stats.frames_not_registered > 0)
+    {
+        std::cout << recording_stats.frames_not_registered
+                  << " frames have no registered depth because the registration workers fell behind." << std::endl;
+    }
+    if (options.record_host_clock && host_clock.valid())
+    {
+        std::cout << "Host clock: drift " << fmt::format("{:.2f}", host_clock.drift_ppm()) << " ppm, mean residual "
+                  << fmt::format("{:.0f}", host_clock.residual_usec()) << " us, " << host_clock.rejected()
+                  << " samples rejected." << std::endl;
+    }
+    if (recording_stats.proxy_frames_skipped > 0)
+    {
+        std::cout << recording_stats.proxy_frames_skipped
+                  << " proxy frames were skipped because the proxy workers fell behind." << std::endl;
+    }
+    if (recording_stats.image_pool_exhausted > 0)
+    {
+        std::cout << "Image buffer pools were exhausted " << recording_stats.image_pool_exhausted
+                  << " times, increase the pool size to stay allocation free." << std::endl;
     }
-    k4a_device_stop_cameras(device);
 
-    std::cout << "Done" << std::endl;
+    if (device != nullptr)
+    {
+        k4a_device_close(device);
+    }
 
-    k4a_device_close(device);
+    if (synthetic_source != nullptr &&
+        !check_simulation(*synthetic_source, options, camera_fps, steady_clock::now() - shutdown_start, dir))
+    {
+        exit_code = 1;
+    }
 
-    return 0;
+    return exit_code;
 }
 
 std::string next_record_name(std::string base, uint32_t counter) {
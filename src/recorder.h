@@ -1,12 +1,36 @@
 #pragma once
 
 #include <atomic>
+#include <string>
 #include <thread>
+#include <vector>
 #include <k4a/k4a.h>
 #include <k4arecord/record.h>
 
+struct recording_stats_t
+{
+    std::atomic<uint64_t> frames_received{0};
+    std::atomic<uint64_t> frames_written{0};
+    std::atomic<uint64_t> frames_failed{0};
+    std::atomic<uint64_t> blocks_created{0};
+    std::atomic<uint64_t> blocks_finalized{0};
+    std::atomic<uint64_t> blocks_kept_temp{0};
+    std::atomic<uint64_t> frames_not_summarized{0};
+    std::atomic<uint64_t> imu_samples_not_summarized{0};
+    // images that got a heap buffer because their ImagePool had none left
+    std::atomic<uint64_t> image_pool_exhausted{0};
+    // captures whose depth was not registered to color because the workers were busy
+    std::atomic<uint64_t> frames_not_registered{0};
+    // proxy frames left out because the proxy workers were busy
+    std::atomic<uint64_t> proxy_frames_skipped{0};
+};
+
 extern std::atomic_bool exiting;
+
+// Ask a running recording to stop, async-signal-safe. The shutdown budget counts from the first request.
+void request_stop();
 extern std::thread backup_thread;
+extern recording_stats_t recording_stats;
 
 static const int32_t defaultExposureAuto = -12;
 static const int32_t defaultGainAuto = -1;
@@ -32,13 +56,129 @@ inline static uint32_t k4a_convert_fps_to_uint(k4a_fps_t fps)
     return fps_int;
 }
 
+inline static void k4a_color_resolution_to_size(k4a_color_resolution_t resolution, int &width, int &height)
+{
+    switch (resolution)
+    {
+    case K4A_COLOR_RESOLUTION_720P:
+        width = 1280;
+        height = 720;
+        break;
+    case K4A_COLOR_RESOLUTION_1080P:
+        width = 1920;
+        height = 1080;
+        break;
+    case K4A_COLOR_RESOLUTION_1440P:
+        width = 2560;
+        height = 1440;
+        break;
+    case K4A_COLOR_RESOLUTION_1536P:
+        width = 2048;
+        height = 1536;
+        break;
+    case K4A_COLOR_RESOLUTION_2160P:
+        width = 3840;
+        height = 2160;
+        break;
+    case K4A_COLOR_RESOLUTION_3072P:
+        width = 4096;
+        height = 3072;
+        break;
+    default:
+        width = 0;
+        height = 0;
+        break;
+    }
+}
+
+inline static void k4a_depth_mode_to_size(k4a_depth_mode_t mode, int &width, int &height)
+{
+    switch (mode)
+    {
+    case K4A_DEPTH_MODE_NFOV_2X2BINNED:
+        width = 320;
+        height = 288;
+        break;
+    case K4A_DEPTH_MODE_NFOV_UNBINNED:
+        width = 640;
+        height = 576;
+        break;
+    case K4A_DEPTH_MODE_WFOV_2X2BINNED:
+        width = 512;
+        height = 512;
+        break;
+    case K4A_DEPTH_MODE_WFOV_UNBINNED:
+    case K4A_DEPTH_MODE_PASSIVE_IR:
+        width = 1024;
+        height = 1024;
+        break;
+    default:
+        width = 0;
+        height = 0;
+        break;
+    }
+}
+
+
+// Device identity written into every block, collected once when the device is opened.
+struct device_info_t
+{
+    std::string serial_number;
+    k4a_hardware_version_t version{};
+    // raw calibration blob as returned by k4a_device_get_raw_calibration, empty for simulated devices
+    std::vector<uint8_t> raw_calibration;
+};
+
+// Rectangle of a stream that is recorded, a width of 0 records the full frame.
+struct roi_t
+{
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+struct recording_options_t
+{
+    int max_block_length = 9000;
+    bool record_imu = true;
+    int32_t absoluteExposureValue = defaultExposureAuto;
+    int32_t gain = defaultGainAuto;
+    bool record_checksums = true;
+    // write per-second content statistics next to every block, see block_summary.h
+    bool record_summaries = true;
+    // move finalized blocks to this directory, empty disables migration
+    std::string migrate_dir;
+    // migration bandwidth cap in bytes per second, 0 means unlimited
+    uint64_t migrate_bandwidth = 0;
+    // write a Chrome trace of per-frame latencies to this file at shutdown, empty disables tracing
+    std::string trace_file;
+    // record from a SyntheticFrameSource with these settings instead of a device, see frame_source.h
+    std::string simulate;
+    // time budget after a stop request to drain queued captures and finalize the open blocks
+    int shutdown_timeout_ms = 10000;
+    // write blocks with the native streaming writer (mkv_writer.h) instead of libk4arecord
+    bool native_writer = false;
+    // open blocks with O_DIRECT, only used by the native writer
+    bool direct_io = false;
+    // write depth registered to the color camera into a REGISTERED_DEPTH track, see depth_registration.h
+    bool registered_depth = false;
+    // write a low resolution companion file with this many frames per second, 0 disables it, see proxy_writer.h
+    uint32_t proxy_fps = 0;
+    // fit device to host clock and write the model into a HOST_CLOCK track, see host_clock.h
+    bool record_host_clock = true;
+    // write only every Nth frame of a stream, see stream_filter.h
+    uint32_t color_decimation = 1;
+    uint32_t depth_decimation = 1;
+    uint32_t ir_decimation = 1;
+    // record only this rectangle of a raw stream into a *_ROI track, depth and IR share one
+    roi_t color_roi;
+    roi_t depth_roi;
+};
 
 int do_recording(uint8_t device_index,
                  std::string base_filename,
-                 int max_block_length,
                  k4a_device_configuration_t *device_config,
-                 bool record_imu,
-                 int32_t absoluteExposureValue,
-                 int32_t gain);
+                 const recording_options_t &options);
 
 std::string next_record_name(std::string base, uint32_t counter);
@@ -0,0 +1,209 @@
+// Drives the recorder with the synthetic frame source and the fault layer (see "Simulation and Fault
+// Injection" in the README) and checks what ends up on disk. The recorder keeps its state in globals,
+// so every case runs in its own process: atlas_simulation_test <case>.
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <k4a/k4a.h>
+#include <k4arecord/playback.h>
+#include <unistd.h>
+
+#include "fault_injection.h"
+#include "recorder.h"
+
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+namespace
+{
+struct sim_case_t
+{
+    std::string simulate;
+    std::string faults = "";
+    int max_block_length = 90;
+    // SIGINT after this long, 0 lets the source run out of frames
+    int stop_after_ms = 3000;
+    int expected_result = 0;
+    // checked after the recording on top of the common checks
+    std::function<bool()> check = nullptr;
+};
+
+const int64_t max_shutdown_ms = 5000;
+
+bool expect(bool condition, const std::string &what)
+{
+    if (!condition)
+    {
+        std::cerr << "FAILED: " << what << std::endl;
+    }
+    return condition;
+}
+
+void on_signal(int)
+{
+    request_stop();
+}
+
+// captures in all finalized blocks of dir, as k4a_playback sees them
+int64_t count_recorded_frames(const fs::path &dir)
+{
+    int64_t frames = 0;
+    for (const auto &entry : fs::directory_iterator(dir))
+    {
+        if (entry.path().extension() != ".mkv" || entry.path().filename().string().rfind("_temp_", 0) == 0)
+        {
+            continue;
+        }
+        k4a_playback_t playback;
+        if (K4A_FAILED(k4a_playback_open(entry.path().c_str(), &playback)))
+        {
+            std::cerr << "Unable to open " << entry.path().string() << std::endl;
+            return -1;
+        }
+        k4a_capture_t capture;
+        while (k4a_playback_get_next_capture(playback, &capture) == K4A_STREAM_RESULT_SUCCEEDED)
+        {
+            k4a_capture_release(capture);
+            ++frames;
+        }
+        k4a_playback_close(playback);
+    }
+    return frames;
+}
+
+size_t count_temp_files(const fs::path &dir)
+{
+    size_t files = 0;
+    for (const auto &entry : fs::directory_iterator(dir))
+    {
+        files += entry.path().filename().string().rfind("_temp_", 0) == 0;
+    }
+    return files;
+}
+
+int run_case(const std::string &name, const sim_case_t &sim)
+{
+    fs::path dir = fs::temp_directory_path() / ("atlas_simulation_test_" + name + "_" + std::to_string(getpid()));
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    if (!sim.faults.empty())
+    {
+        fault_injection_configure(sim.faults);
+    }
+    struct sigaction act = {};
+    act.sa_handler = on_signal;
+    sigemptyset(&act.sa_mask);
+    sigaction(SIGINT, &act, nullptr);
+
+    k4a_device_configuration_t config = K4A_DEVICE_CONFIG_INIT_DISABLE_ALL;
+    config.color_format = K4A_IMAGE_FORMAT_COLOR_MJPG;
+    config.color_resolution = K4A_COLOR_RESOLUTION_720P;
+    config.depth_mode = K4A_DEPTH_MODE_NFOV_UNBINNED;
+    config.camera_fps = K4A_FRAMES_PER_SECOND_30;
+
+    recording_options_t options;
+    options.max_block_length = sim.max_block_length;
+    options.simulate = sim.simulate + ",max_shutdown_ms=" + std::to_string(max_shutdown_ms);
+    options.shutdown_timeout_ms = static_cast<int>(max_shutdown_ms);
+
+    // the stop is measured from the moment the signal is delivered, not from when the recorder notices it
+    std::atomic<int64_t> signal_sent_ns{0};
+    std::thread stopper;
+    if (sim.stop_after_ms > 0)
+    {
+        stopper = std::thread([&]() {
+            std::this_thread::sleep_for(milliseconds(sim.stop_after_ms));
+            signal_sent_ns = steady_clock::now().time_since_epoch().count();
+            kill(getpid(), SIGINT);
+        });
+    }
+    int result = do_recording(0, (dir / "sim.mkv").string(), &config, options);
+    auto returned = steady_clock::now();
+    if (stopper.joinable())
+    {
+        stopper.join();
+    }
+
+    bool ok = expect(result == sim.expected_result, "do_recording returned " + std::to_string(result));
+    if (sim.stop_after_ms > 0)
+    {
+        auto shutdown = returned - steady_clock::time_point(steady_clock::duration(signal_sent_ns.load()));
+        int64_t shutdown_ms = duration_cast<milliseconds>(shutdown).count();
+        ok &= expect(shutdown_ms <= max_shutdown_ms,
+                     "shutdown took " + std::to_string(shutdown_ms) + "ms after the signal");
+    }
+    ok &= expect(recording_stats.blocks_created == recording_stats.blocks_finalized + recording_stats.blocks_kept_temp,
+                 "every block is finalized or kept as temp file");
+    ok &= expect(count_temp_files(dir) == recording_stats.blocks_kept_temp, "temp files on disk match the report");
+    if (recording_stats.blocks_kept_temp == 0)
+    {
+        int64_t recorded = count_recorded_frames(dir);
+        ok &= expect(recorded == static_cast<int64_t>(recording_stats.frames_written),
+                     std::to_string(recorded) + " frames on disk, " +
+                         std::to_string(recording_stats.frames_written) + " reported written");
+    }
+    if (sim.check)
+    {
+        ok &= sim.check();
+    }
+
+    if (ok)
+    {
+        fs::remove_all(dir);
+        std::cout << name << ": passed" << std::endl;
+    }
+    else
+    {
+        std::cerr << name << ": recording left in " << dir.string() << std::endl;
+    }
+    return ok ? 0 : 1;
+}
+} // namespace
+
+int main(int argc, char **argv)
+{
+    // frames_dropped is asserted by the recorder itself, check_simulation() fails the run when a stall that
+    // fits into the buffer loses frames
+    std::map<std::string, sim_case_t> cases;
+    // 60ms device stalls and 20ms write stalls fit into 3 frames of 33ms
+    cases["stall_within_buffer"] = {"frames=100000,stall_every=45,stall_ms=60,buffer=3,seed=3",
+                                    "write_latency_ms=20,write_latency_rate=0.05,seed=3"};
+    // stalls longer than the buffer lose frames, which must not fail the run or the blocks
+    cases["stall_beyond_buffer"] = {"frames=100000,stall_every=45,stall_ms=250,buffer=2"};
+    // slow and failing finalizers, blocks are kept as temp files but none is lost
+    cases["slow_finalize"] = {"frames=100000", "flush_delay_ms=800,rename_fail_rate=0.3,seed=5", 30, 3500, 0,
+                              []() {
+                                  return expect(recording_stats.blocks_created >= 3, "several blocks were created");
+                              }};
+    // the disk fills up, the open block is finalized with what was written and the recorder fails
+    cases["disk_full"] = {"frames=100000", "enospc_after_mb=20", 30, 0, 1, []() {
+                              return expect(recording_stats.frames_failed == 1, "exactly one write failed");
+                          }};
+    // the source runs dry without a stop request
+    cases["source_finished"] = {"frames=75,jitter_ms=5", "", 30, 0, 0, []() {
+                                    return expect(recording_stats.frames_written == 74,
+                                                  "all frames but the startup capture are written");
+                                }};
+
+    if (argc != 2 || cases.count(argv[1]) == 0)
+    {
+        std::cerr << "atlas_simulation_test <case>, cases:";
+        for (const auto &entry : cases)
+        {
+            std::cerr << " " << entry.first;
+        }
+        std::cerr << std::endl;
+        return 2;
+    }
+    return run_case(argv[1], cases[argv[1]]);
+}
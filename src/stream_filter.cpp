@@ -0,0 +1,321 @@
+#include "stream_filter.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <fmt/core.h>
+
+namespace
+{
+bool cropped(const roi_t &roi)
+{
+    return roi.width > 0;
+}
+
+size_t roi_bytes(const roi_t &roi, k4a_image_format_t format)
+{
+    size_t pixels = static_cast<size_t>(roi.width) * roi.height;
+    switch (format)
+    {
+    case K4A_IMAGE_FORMAT_COLOR_NV12:
+        return pixels * 3 / 2;
+    case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+        return pixels * 4;
+    default:
+        return pixels * 2;
+    }
+}
+
+std::vector<uint8_t> roi_codec_private(const roi_t &roi, k4a_image_format_t format)
+{
+    switch (format)
+    {
+    case K4A_IMAGE_FORMAT_COLOR_NV12:
+        return bitmap_info_header(roi.width, roi.height, 12, "NV12");
+    case K4A_IMAGE_FORMAT_COLOR_YUY2:
+        return bitmap_info_header(roi.width, roi.height, 16, "YUY2");
+    case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+        return bitmap_info_header(roi.width, roi.height, 32, "\0\0\0\0");
+    default:
+        return bitmap_info_header(roi.width, roi.height, 16, "b16g");
+    }
+}
+
+void copy_rows(const uint8_t *source, int stride, int rows, size_t row_offset, size_t row_bytes, uint8_t *out)
+{
+    for (int row = 0; row < rows; ++row)
+    {
+        std::memcpy(out, source + static_cast<size_t>(row) * stride + row_offset, row_bytes);
+        out += row_bytes;
+    }
+}
+
+// 16 bit rows to big endian ("b16g")
+void copy_rows_swapped(const uint8_t *source, int stride, int rows, size_t row_offset, size_t row_bytes, uint8_t *out)
+{
+    for (int row = 0; row < rows; ++row)
+    {
+        const uint8_t *in = source + static_cast<size_t>(row) * stride + row_offset;
+        for (size_t i = 0; i < row_bytes; i += 2)
+        {
+            out[i] = in[i + 1];
+            out[i + 1] = in[i];
+        }
+        out += row_bytes;
+    }
+}
+} // namespace
+
+k4a_device_configuration_t writer_configuration(const k4a_device_configuration_t &config,
+                                                const recording_options_t &options)
+{
+    k4a_device_configuration_t writer_config = config;
+    if (cropped(options.color_roi))
+    {
+        writer_config.color_resolution = K4A_COLOR_RESOLUTION_OFF;
+    }
+    if (cropped(options.depth_roi))
+    {
+        writer_config.depth_mode = K4A_DEPTH_MODE_OFF;
+    }
+    return writer_config;
+}
+
+size_t roi_frame_size(const k4a_device_configuration_t &config, const recording_options_t &options)
+{
+    size_t size = 0;
+    if (cropped(options.color_roi))
+    {
+        size += roi_bytes(options.color_roi, config.color_format);
+    }
+    if (cropped(options.depth_roi))
+    {
+        // depth and IR
+        size += roi_bytes(options.depth_roi, K4A_IMAGE_FORMAT_DEPTH16) * 2;
+    }
+    return size;
+}
+
+StreamFilter::StreamFilter(const k4a_device_configuration_t &config, const recording_options_t &options) :
+    m_config(config),
+    m_period_usec(1000000 / k4a_convert_fps_to_uint(config.camera_fps))
+{
+    m_streams[COLOR].name = "COLOR";
+    m_streams[COLOR].roi_track = color_roi_track_name;
+    m_streams[COLOR].decimation = options.color_decimation;
+    m_streams[COLOR].roi = options.color_roi;
+    k4a_color_resolution_to_size(config.color_resolution, m_streams[COLOR].frame_width, m_streams[COLOR].frame_height);
+    m_streams[DEPTH].name = "DEPTH";
+    m_streams[DEPTH].roi_track = depth_roi_track_name;
+    m_streams[DEPTH].decimation = options.depth_decimation;
+    m_streams[DEPTH].roi = options.depth_roi;
+    m_streams[IR].name = "IR";
+    m_streams[IR].roi_track = ir_roi_track_name;
+    m_streams[IR].decimation = options.ir_decimation;
+    m_streams[IR].roi = options.depth_roi;
+    for (stream_t depth_stream : {DEPTH, IR})
+    {
+        k4a_depth_mode_to_size(config.depth_mode, m_streams[depth_stream].frame_width,
+                               m_streams[depth_stream].frame_height);
+    }
+
+    for (Stream &stream : m_streams)
+    {
+        if (stream.decimation == 0)
+        {
+            throw std::runtime_error(fmt::format("{} decimation must be at least 1.", stream.name));
+        }
+        const roi_t &roi = stream.roi;
+        if (!cropped(roi))
+        {
+            continue;
+        }
+        if (stream.frame_width == 0)
+        {
+            throw std::runtime_error(fmt::format("{} is cropped but not recorded.", stream.name));
+        }
+        if (roi.x < 0 || roi.y < 0 || roi.height <= 0 || roi.x + roi.width > stream.frame_width ||
+            roi.y + roi.height > stream.frame_height)
+        {
+            throw std::runtime_error(fmt::format("{} ROI {},{},{},{} is outside the {}x{} frame.", stream.name, roi.x,
+                                                 roi.y, roi.width, roi.height, stream.frame_width,
+                                                 stream.frame_height));
+        }
+        if (&stream == &m_streams[COLOR])
+        {
+            switch (config.color_format)
+            {
+            case K4A_IMAGE_FORMAT_COLOR_NV12:
+                if ((roi.x | roi.y | roi.width | roi.height) & 1)
+                {
+                    throw std::runtime_error("NV12 ROI position and size must be even.");
+                }
+                break;
+            case K4A_IMAGE_FORMAT_COLOR_YUY2:
+                if ((roi.x | roi.width) & 1)
+                {
+                    throw std::runtime_error("YUY2 ROI x and width must be even.");
+                }
+                break;
+            case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+                break;
+            default:
+                throw std::runtime_error("Color cropping needs a raw color format (NV12, YUY2 or BGRA32).");
+            }
+        }
+        stream.buffer.resize(roi_bytes(roi, &stream == &m_streams[COLOR] ? config.color_format
+                                                                         : K4A_IMAGE_FORMAT_DEPTH16));
+    }
+}
+
+bool StreamFilter::active() const
+{
+    for (const Stream &stream : m_streams)
+    {
+        if (stream.decimation > 1 || cropped(stream.roi))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+k4a_result_t StreamFilter::add_tracks(BlockWriter &writer)
+{
+    uint32_t fps = k4a_convert_fps_to_uint(m_config.camera_fps);
+    for (int i = COLOR; i <= IR; ++i)
+    {
+        Stream &stream = m_streams[i];
+        // a new block starts with a kept frame
+        stream.next_keep_usec = 0;
+        if (stream.frame_width == 0 || (i == DEPTH && m_config.depth_mode == K4A_DEPTH_MODE_PASSIVE_IR))
+        {
+            continue;
+        }
+        if (stream.decimation > 1 &&
+            K4A_FAILED(writer.add_tag(fmt::format("ATLAS_{}_DECIMATION", stream.name).c_str(),
+                                      std::to_string(stream.decimation).c_str())))
+        {
+            return K4A_RESULT_FAILED;
+        }
+        if (!cropped(stream.roi))
+        {
+            continue;
+        }
+        const roi_t &roi = stream.roi;
+        std::string value = fmt::format("x={},y={},width={},height={},frame_width={},frame_height={}", roi.x, roi.y,
+                                        roi.width, roi.height, stream.frame_width, stream.frame_height);
+        if (K4A_FAILED(writer.add_tag(fmt::format("ATLAS_{}_ROI", stream.name).c_str(), value.c_str())))
+        {
+            return K4A_RESULT_FAILED;
+        }
+        std::vector<uint8_t> codec_private =
+            roi_codec_private(roi, i == COLOR ? m_config.color_format : K4A_IMAGE_FORMAT_DEPTH16);
+        k4a_record_video_settings_t settings = {static_cast<uint64_t>(roi.width), static_cast<uint64_t>(roi.height),
+                                                std::max<uint64_t>(fps / stream.decimation, 1)};
+        if (K4A_FAILED(writer.add_custom_video_track(stream.roi_track, "V_MS/VFW/FOURCC", codec_private.data(),
+                                                     codec_private.size(), &settings)))
+        {
+            return K4A_RESULT_FAILED;
+        }
+    }
+    return K4A_RESULT_SUCCEEDED;
+}
+
+bool StreamFilter::keep(Stream &stream, k4a_image_t image)
+{
+    uint64_t timestamp = k4a_image_get_device_timestamp_usec(image);
+    if (stream.decimation <= 1)
+    {
+        return true;
+    }
+    if (timestamp < stream.next_keep_usec)
+    {
+        return false;
+    }
+    stream.next_keep_usec = timestamp + stream.decimation * m_period_usec - m_period_usec / 2;
+    return true;
+}
+
+void StreamFilter::crop(Stream &stream, k4a_image_t image)
+{
+    const roi_t &roi = stream.roi;
+    const uint8_t *data = k4a_image_get_buffer(image);
+    int stride = k4a_image_get_stride_bytes(image);
+    uint8_t *out = stream.buffer.data();
+    switch (k4a_image_get_format(image))
+    {
+    case K4A_IMAGE_FORMAT_COLOR_NV12:
+        copy_rows(data + static_cast<size_t>(roi.y) * stride, stride, roi.height, roi.x, roi.width, out);
+        // interleaved UV plane at half vertical resolution below the luma plane
+        copy_rows(data + static_cast<size_t>(stream.frame_height + roi.y / 2) * stride, stride, roi.height / 2, roi.x,
+                  roi.width, out + static_cast<size_t>(roi.width) * roi.height);
+        break;
+    case K4A_IMAGE_FORMAT_COLOR_YUY2:
+        copy_rows(data + static_cast<size_t>(roi.y) * stride, stride, roi.height, roi.x * 2, roi.width * 2, out);
+        break;
+    case K4A_IMAGE_FORMAT_COLOR_BGRA32:
+        copy_rows(data + static_cast<size_t>(roi.y) * stride, stride, roi.height, roi.x * 4, roi.width * 4, out);
+        break;
+    default:
+        copy_rows_swapped(data + static_cast<size_t>(roi.y) * stride, stride, roi.height, roi.x * 2, roi.width * 2,
+                          out);
+        break;
+    }
+}
+
+k4a_result_t StreamFilter::write_capture(BlockWriter &writer, k4a_capture_t capture)
+{
+    k4a_image_t images[] = {k4a_capture_get_color_image(capture),
+                            k4a_capture_get_depth_image(capture),
+                            k4a_capture_get_ir_image(capture)};
+    k4a_capture_t full_frames = nullptr;
+    bool has_full_frames = false;
+    k4a_result_t result = k4a_capture_create(&full_frames);
+    for (int i = COLOR; i <= IR && K4A_SUCCEEDED(result); ++i)
+    {
+        Stream &stream = m_streams[i];
+        if (images[i] == nullptr || !keep(stream, images[i]))
+        {
+            continue;
+        }
+        if (cropped(stream.roi))
+        {
+            crop(stream, images[i]);
+            result = writer.write_custom_track_data(stream.roi_track, k4a_image_get_device_timestamp_usec(images[i]),
+                                                    stream.buffer.data(), stream.buffer.size());
+            continue;
+        }
+        switch (i)
+        {
+        case COLOR:
+            k4a_capture_set_color_image(full_frames, images[i]);
+            break;
+        case DEPTH:
+            k4a_capture_set_depth_image(full_frames, images[i]);
+            break;
+        default:
+            k4a_capture_set_ir_image(full_frames, images[i]);
+            break;
+        }
+        has_full_frames = true;
+    }
+    if (K4A_SUCCEEDED(result) && has_full_frames)
+    {
+        k4a_capture_set_temperature_c(full_frames, k4a_capture_get_temperature_c(capture));
+        result = writer.write_capture(full_frames);
+    }
+    if (full_frames != nullptr)
+    {
+        k4a_capture_release(full_frames);
+    }
+    for (k4a_image_t image : images)
+    {
+        if (image != nullptr)
+        {
+            k4a_image_release(image);
+        }
+    }
+    return result;
+}
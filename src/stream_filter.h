@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <k4a/k4a.h>
+
+#include "block_writer.h"
+#include "recorder.h"
+
+// Custom tracks that take a stream when it is cropped, the full-frame track of that stream is left out.
+static const char *const color_roi_track_name = "COLOR_ROI";
+static const char *const depth_roi_track_name = "DEPTH_ROI";
+static const char *const ir_roi_track_name = "IR_ROI";
+
+// Configuration the block writer is created with: streams that are cropped are turned off, since
+// the COLOR/DEPTH/IR tracks must have the full sensor resolution of their mode.
+k4a_device_configuration_t writer_configuration(const k4a_device_configuration_t &config,
+                                                const recording_options_t &options);
+
+// Bytes of ROI track data per capture.
+size_t roi_frame_size(const k4a_device_configuration_t &config, const recording_options_t &options);
+
+// Per-stream rate decimation and ROI cropping between capture and block writer.
+//
+// A stream with decimation N keeps a frame, then drops those less than N - 1/2 frame periods after it in
+// device time, so lost frames do not shift the pattern. Captures keep their full-frame images for the
+// other consumers (summaries, proxies, registration), only what is written to the block is reduced.
+// Cropping works on raw formats (NV12, YUY2, BGRA32, depth, IR): the rectangle is copied row by row
+// into a buffer that is reused for every frame and written to the stream's *_ROI custom track in the
+// format of the full-frame track (16 bit samples big endian). Depth and IR share one rectangle.
+class StreamFilter
+{
+public:
+    // Throws std::runtime_error on rectangles outside the frame or not aligned to the chroma subsampling.
+    StreamFilter(const k4a_device_configuration_t &config, const recording_options_t &options);
+
+    bool active() const;
+
+    // Add the ROI tracks and the ATLAS_*_ROI / ATLAS_*_DECIMATION tags, before write_header.
+    k4a_result_t add_tracks(BlockWriter &writer);
+
+    // Write what is left of the capture. The caller keeps its reference to capture.
+    k4a_result_t write_capture(BlockWriter &writer, k4a_capture_t capture);
+
+private:
+    enum stream_t
+    {
+        COLOR = 0,
+        DEPTH = 1,
+        IR = 2,
+    };
+
+    struct Stream
+    {
+        const char *name;
+        const char *roi_track;
+        uint32_t decimation = 1;
+        roi_t roi;
+        int frame_width = 0;
+        int frame_height = 0;
+        uint64_t next_keep_usec = 0;
+        std::vector<uint8_t> buffer;
+    };
+
+    bool keep(Stream &stream, k4a_image_t image);
+    void crop(Stream &stream, k4a_image_t image);
+
+    k4a_device_configuration_t m_config;
+    uint64_t m_period_usec;
+    Stream m_streams[3];
+};
@@ -0,0 +1,122 @@
+#include "task_pool.h"
+
+namespace
+{
+// index of the pool worker running on this thread, -1 on other threads
+thread_local int current_worker = -1;
+thread_local const TaskPool *current_pool = nullptr;
+} // namespace
+
+TaskPool::TaskPool(unsigned threads)
+{
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        m_queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        m_workers.emplace_back(&TaskPool::run, this, i);
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    wait_idle();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_work_cv.notify_all();
+    for (auto &worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+void TaskPool::submit(Task task)
+{
+    unsigned index = current_pool == this ? static_cast<unsigned>(current_worker)
+                                          : m_next_queue++ % static_cast<unsigned>(m_queues.size());
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_queued;
+        ++m_unfinished;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+        m_queues[index]->tasks.push_back(std::move(task));
+    }
+    m_work_cv.notify_one();
+}
+
+void TaskPool::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_idle_cv.wait(lock, [this]() { return m_unfinished == 0; });
+}
+
+bool TaskPool::pop_or_steal(unsigned index, Task &task)
+{
+    {
+        Queue &own = *m_queues[index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < m_queues.size(); ++i)
+    {
+        Queue &victim = *m_queues[(index + i) % m_queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskPool::run(unsigned index)
+{
+    current_worker = static_cast<int>(index);
+    current_pool = this;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_work_cv.wait(lock, [this]() { return m_queued > 0 || m_stopping; });
+            if (m_queued == 0)
+            {
+                return;
+            }
+            // claim one task, it is in some queue and only claimed workers take tasks
+            --m_queued;
+        }
+        Task task;
+        while (!pop_or_steal(index, task))
+        {
+            // the claimed task is being pushed right now
+            std::this_thread::yield();
+        }
+        task();
+        task = nullptr;
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            idle = --m_unfinished == 0;
+        }
+        if (idle)
+        {
+            m_idle_cv.notify_all();
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool for offline processing.
+//
+// Every worker owns a deque: tasks submitted from a worker go to the back of its own deque and it
+// takes its newest task first, which keeps a block's decode and encode work on a warm cache. An idle
+// worker steals the oldest task of another worker. Tasks submitted from outside are spread round-robin.
+// Tasks must not block on other tasks, follow-up work is submitted from inside a task instead.
+class TaskPool
+{
+public:
+    using Task = std::function<void()>;
+
+    explicit TaskPool(unsigned threads);
+    ~TaskPool();
+    TaskPool(const TaskPool &) = delete;
+    TaskPool &operator=(const TaskPool &) = delete;
+
+    void submit(Task task);
+
+    // Wait until all submitted tasks, including those they submitted, have run.
+    void wait_idle();
+
+    unsigned size() const
+    {
+        return static_cast<unsigned>(m_queues.size());
+    }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void run(unsigned index);
+    bool pop_or_steal(unsigned index, Task &task);
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    std::vector<std::thread> m_workers;
+    std::atomic<unsigned> m_next_queue{0};
+
+    // tasks submitted and not yet finished, guarded by m_mutex for the sleep/wake handshake
+    std::mutex m_mutex;
+    std::condition_variable m_work_cv;
+    std::condition_variable m_idle_cv;
+    size_t m_queued = 0;
+    size_t m_unfinished = 0;
+    bool m_stopping = false;
+};
@@ -0,0 +1,229 @@
+#include "trace.h"
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <fmt/core.h>
+
+using namespace std::chrono;
+
+std::atomic_bool trace_active(false);
+
+namespace
+{
+struct TraceEvent
+{
+    const char *name;
+    char phase;
+    uint64_t ts_usec;
+    uint64_t dur_usec;
+    const char *arg_name;
+    int64_t arg_value;
+    const char *arg2_name;
+    int64_t arg2_value;
+};
+
+// fixed size chunks, a full chunk is never moved so appending needs no lock
+static const size_t events_per_chunk = 16384;
+// a thread keeps its newest 256k events (14 MB), older ones are overwritten and counted as dropped
+static const size_t chunks_per_thread = 16;
+static const size_t events_per_thread = events_per_chunk * chunks_per_thread;
+
+struct ThreadBuffer
+{
+    int tid;
+    std::string name;
+    std::vector<std::unique_ptr<TraceEvent[]>> chunks;
+    // events appended over the buffer's lifetime, the ring holds the last events_per_thread of them
+    size_t count = 0;
+    // owned by a running thread, a free buffer is handed to the next thread of the same name
+    bool in_use = true;
+
+    void append(const TraceEvent &event)
+    {
+        size_t index = count % events_per_thread;
+        if (index % events_per_chunk == 0 && index / events_per_chunk == chunks.size())
+        {
+            chunks.emplace_back(new TraceEvent[events_per_chunk]);
+        }
+        chunks[index / events_per_chunk][index % events_per_chunk] = event;
+        ++count;
+    }
+
+    size_t dropped() const
+    {
+        return count > events_per_thread ? count - events_per_thread : 0;
+    }
+};
+
+steady_clock::time_point trace_start;
+std::mutex registry_mutex;
+std::vector<std::unique_ptr<ThreadBuffer>> registry;
+
+// releases the buffer when its thread exits, the finalizer starts a thread per block
+struct ThreadRegistration
+{
+    ThreadBuffer *buffer = nullptr;
+
+    ~ThreadRegistration()
+    {
+        if (buffer != nullptr)
+        {
+            std::lock_guard<std::mutex> lock(registry_mutex);
+            buffer->in_use = false;
+        }
+    }
+};
+thread_local ThreadRegistration local_registration;
+
+ThreadBuffer &thread_buffer(const char *name = "")
+{
+    ThreadBuffer *&buffer = local_registration.buffer;
+    if (buffer == nullptr)
+    {
+        // registration is the only synchronized step, once per thread
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (const auto &candidate : registry)
+        {
+            if (!candidate->in_use && candidate->name == name)
+            {
+                candidate->in_use = true;
+                buffer = candidate.get();
+                return *buffer;
+            }
+        }
+        registry.emplace_back(std::make_unique<ThreadBuffer>());
+        buffer = registry.back().get();
+        buffer->tid = static_cast<int>(registry.size());
+        buffer->name = name;
+    }
+    return *buffer;
+}
+
+void write_args(std::ofstream &out, const TraceEvent &event)
+{
+    if (event.arg_name == nullptr)
+    {
+        return;
+    }
+    out << ",\"args\":{\"" << event.arg_name << "\":" << event.arg_value;
+    if (event.arg2_name != nullptr)
+    {
+        out << ",\"" << event.arg2_name << "\":" << event.arg2_value;
+    }
+    out << "}";
+}
+} // namespace
+
+void trace_enable()
+{
+    trace_start = steady_clock::now();
+    trace_active = true;
+}
+
+uint64_t trace_now_usec()
+{
+    return static_cast<uint64_t>(duration_cast<microseconds>(steady_clock::now() - trace_start).count());
+}
+
+void trace_set_thread_name(const char *name)
+{
+    if (trace_enabled())
+    {
+        thread_buffer(name).name = name;
+    }
+}
+
+void trace_complete(const char *name,
+                    uint64_t start_usec,
+                    uint64_t end_usec,
+                    const char *arg_name,
+                    int64_t arg_value,
+                    const char *arg2_name,
+                    int64_t arg2_value)
+{
+    thread_buffer().append(
+        TraceEvent{name, 'X', start_usec, end_usec - start_usec, arg_name, arg_value, arg2_name, arg2_value});
+}
+
+void trace_instant(const char *name, const char *arg_name, int64_t arg_value, const char *arg2_name, int64_t arg2_value)
+{
+    thread_buffer().append(TraceEvent{name, 'i', trace_now_usec(), 0, arg_name, arg_value, arg2_name, arg2_value});
+}
+
+bool trace_export(const std::string &filename)
+{
+    std::ofstream out(filename);
+    if (!out.is_open())
+    {
+        std::cerr << "Unable to write trace file: " << filename << std::endl;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    size_t total = 0;
+    size_t dropped = 0;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (const auto &buffer : registry)
+    {
+        if (!buffer->name.empty())
+        {
+            out << (first ? "" : ",") << "\n"
+                << fmt::format(R"({{"name":"thread_name","ph":"M","pid":1,"tid":{},"args":{{"name":"{}"}}}})",
+                               buffer->tid,
+                               buffer->name);
+            first = false;
+        }
+        size_t kept = buffer->count - buffer->dropped();
+        if (buffer->dropped() > 0)
+        {
+            // marks where the thread's trace starts, its earlier events were overwritten
+            size_t oldest = buffer->count % events_per_thread;
+            const TraceEvent &start = buffer->chunks[oldest / events_per_chunk][oldest % events_per_chunk];
+            out << (first ? "" : ",") << "\n"
+                << fmt::format(R"({{"name":"trace_events_dropped","ph":"i","pid":1,"tid":{},"ts":{},"s":"t",)"
+                               R"("args":{{"count":{}}}}})",
+                               buffer->tid,
+                               start.ts_usec,
+                               buffer->dropped());
+            first = false;
+        }
+        for (size_t n = 0; n < kept; ++n)
+        {
+            size_t i = (buffer->count - kept + n) % events_per_thread;
+            const TraceEvent &event = buffer->chunks[i / events_per_chunk][i % events_per_chunk];
+            out << (first ? "" : ",") << "\n"
+                << fmt::format(R"({{"name":"{}","ph":"{}","pid":1,"tid":{},"ts":{})",
+                               event.name,
+                               event.phase,
+                               buffer->tid,
+                               event.ts_usec);
+            if (event.phase == 'X')
+            {
+                out << ",\"dur\":" << event.dur_usec;
+            }
+            else
+            {
+                out << ",\"s\":\"t\"";
+            }
+            write_args(out, event);
+            out << "}";
+            first = false;
+        }
+        total += kept;
+        dropped += buffer->dropped();
+    }
+    out << "\n]}" << std::endl;
+
+    std::cout << "Wrote " << total << " trace events to " << filename;
+    if (dropped > 0)
+    {
+        std::cout << ", " << dropped << " older events were dropped";
+    }
+    std::cout << std::endl;
+    return out.good();
+}
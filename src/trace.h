@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Opt-in per-frame latency tracing, exported as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+// Every thread appends to its own bounded ring buffer without locking, the buffers are only read by
+// trace_export() which must be called after all traced threads have been joined.
+
+extern std::atomic_bool trace_active;
+
+void trace_enable();
+
+inline bool trace_enabled()
+{
+    return trace_active.load(std::memory_order_relaxed);
+}
+
+uint64_t trace_now_usec();
+
+void trace_set_thread_name(const char *name);
+
+// name and arg names must be string literals, only the pointers are stored
+void trace_complete(const char *name,
+                    uint64_t start_usec,
+                    uint64_t end_usec,
+                    const char *arg_name = nullptr,
+                    int64_t arg_value = 0,
+                    const char *arg2_name = nullptr,
+                    int64_t arg2_value = 0);
+void trace_instant(const char *name,
+                   const char *arg_name = nullptr,
+                   int64_t arg_value = 0,
+                   const char *arg2_name = nullptr,
+                   int64_t arg2_value = 0);
+
+bool trace_export(const std::string &filename);
+
+// Records a complete event covering the lifetime of the scope.
+class TraceScope
+{
+public:
+    TraceScope(const char *name, const char *arg_name = nullptr, int64_t arg_value = 0) :
+        m_name(name),
+        m_arg_name(arg_name),
+        m_arg_value(arg_value),
+        m_start(trace_enabled() ? trace_now_usec() : 0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (trace_enabled())
+        {
+            trace_complete(m_name, m_start, trace_now_usec(), m_arg_name, m_arg_value);
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *m_name;
+    const char *m_arg_name;
+    int64_t m_arg_value;
+    uint64_t m_start;
+};